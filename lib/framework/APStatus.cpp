@@ -11,12 +11,14 @@ APStatus::APStatus(AsyncWebServer* server, SecurityManager* securityManager, APS
 void APStatus::apStatus(AsyncWebServerRequest* request) {
   AsyncJsonResponse* response = new AsyncJsonResponse(false, MAX_AP_STATUS_SIZE);
   JsonObject root = response->getRoot();
+  readStatus(root);
+  response->setLength();
+  request->send(response);
+}
 
+void APStatus::readStatus(JsonObject& root) {
   root["status"] = _apSettingsService->getAPNetworkStatus();
   root["ip_address"] = WiFi.softAPIP().toString();
   root["mac_address"] = WiFi.softAPmacAddress();
   root["station_num"] = WiFi.softAPgetStationNum();
-
-  response->setLength();
-  request->send(response);
 }
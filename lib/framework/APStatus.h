@@ -23,6 +23,8 @@ class APStatus {
  public:
   APStatus(AsyncWebServer* server, SecurityManager* securityManager, APSettingsService* apSettingsService);
 
+  void readStatus(JsonObject& root);
+
  private:
   APSettingsService* _apSettingsService;
   void apStatus(AsyncWebServerRequest* request);
@@ -0,0 +1,94 @@
+#include <BootSequence.h>
+
+BootSequence::BootSequence(AsyncWebServer* server, SecurityManager* securityManager) :
+    _count(0), _next(0), _callbackCount(0), _begun(false), _complete(false), _completedAt(0) {
+  server->on(BOOT_STATUS_SERVICE_PATH,
+             HTTP_GET,
+             securityManager->wrapRequest(std::bind(&BootSequence::bootStatus, this, std::placeholders::_1),
+                                          AuthenticationPredicates::IS_AUTHENTICATED));
+}
+
+bool BootSequence::addStage(const char* name, BootStageLoader loader, bool deferred) {
+  if (_count == BOOT_SEQUENCE_MAX_STAGES || _complete || (_begun && !deferred)) {
+    return false;
+  }
+  _stages[_count++] = {name, loader, deferred, false, 0, 0};
+  return true;
+}
+
+bool BootSequence::onComplete(BootCompleteCallback callback) {
+  if (_complete) {
+    callback();
+    return true;
+  }
+  if (_callbackCount == BOOT_SEQUENCE_MAX_CALLBACKS) {
+    return false;
+  }
+  _callbacks[_callbackCount++] = callback;
+  return true;
+}
+
+void BootSequence::begin() {
+  _begun = true;
+  for (uint8_t i = 0; i < _count; i++) {
+    if (!_stages[i].deferred) {
+      loadStage(_stages[i]);
+    }
+  }
+}
+
+void BootSequence::loop() {
+  if (!_begun || _complete) {
+    return;
+  }
+  // load at most one deferred stage per call, skipping over the eager stages
+  while (_next < _count && _stages[_next].loaded) {
+    _next++;
+  }
+  if (_next < _count) {
+    loadStage(_stages[_next++]);
+    return;
+  }
+  _complete = true;
+  _completedAt = millis();
+  Serial.printf_P(PSTR("Boot sequence complete after %lu ms\r\n"), _completedAt);
+  for (uint8_t i = 0; i < _callbackCount; i++) {
+    _callbacks[i]();
+  }
+}
+
+void BootSequence::loadStage(BootStage& stage) {
+  unsigned long startedAt = micros();
+  stage.loader();
+  stage.duration = micros() - startedAt;
+  stage.loadedAt = millis();
+  stage.loaded = true;
+  Serial.printf_P(PSTR("Loaded %s in %lu us%s\r\n"), stage.name, stage.duration, stage.deferred ? " (deferred)" : "");
+}
+
+void BootSequence::bootStatus(AsyncWebServerRequest* request) {
+  AsyncJsonResponse* response = new AsyncJsonResponse(false, MAX_BOOT_STATUS_SIZE);
+  JsonObject root = response->getRoot();
+  readStatus(root);
+  response->setLength();
+  request->send(response);
+}
+
+void BootSequence::readStatus(JsonObject& root) {
+  root["complete"] = _complete;
+  if (_complete) {
+    root["completed_at_ms"] = _completedAt;
+  }
+  JsonArray stages = root.createNestedArray("stages");
+  for (uint8_t i = 0; i < _count; i++) {
+    const BootStage& stage = _stages[i];
+    JsonObject entry = stages.createNestedObject();
+    entry["name"] = stage.name;
+    entry["deferred"] = stage.deferred;
+    entry["loaded"] = stage.loaded;
+    if (stage.loaded) {
+      entry["loaded_at_ms"] = stage.loadedAt;
+      entry["duration_us"] = stage.duration;
+    }
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef BootSequence_h
+#define BootSequence_h
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <AsyncJson.h>
+#include <ESPAsyncWebServer.h>
+#include <SecurityManager.h>
+
+#include <functional>
+
+#ifndef BOOT_SEQUENCE_MAX_STAGES
+#define BOOT_SEQUENCE_MAX_STAGES 12
+#endif
+
+#ifndef BOOT_SEQUENCE_MAX_CALLBACKS
+#define BOOT_SEQUENCE_MAX_CALLBACKS 4
+#endif
+
+#define MAX_BOOT_STATUS_SIZE 1024
+#define BOOT_STATUS_SERVICE_PATH "/rest/bootStatus"
+
+typedef std::function<void()> BootStageLoader;
+typedef std::function<void()> BootCompleteCallback;
+
+/**
+ * Loads the services in stages and records how long each one took. Eager stages are loaded by begin(), in the order
+ * they were added. Deferred stages are loaded one per call to loop(), so the WiFi and AP services get to bring up
+ * networking before the remaining settings are read from the filesystem.
+ *
+ * Deferral only spreads the loading over the first iterations of the main loop: the stages still load one after the
+ * other on the loop's task, not on another task or core, and a deferred stage is loaded in turn rather than on its
+ * first use. Loading them elsewhere would run each service's begin() alongside the loop and the web server.
+ *
+ * The timings are printed over serial as each stage completes and served on BOOT_STATUS_SERVICE_PATH.
+ */
+class BootSequence {
+ public:
+  BootSequence(AsyncWebServer* server, SecurityManager* securityManager);
+
+  /**
+   * Adds a stage to the sequence, returns false if the sequence is full, if an eager stage is added after begin() or
+   * if the sequence has already completed.
+   */
+  bool addStage(const char* name, BootStageLoader loader, bool deferred = false);
+
+  /**
+   * Registers a callback made once, from loop(), when the last stage has loaded. The callback is made straight away if
+   * the sequence has already completed. Returns false if there are too many callbacks.
+   */
+  bool onComplete(BootCompleteCallback callback);
+
+  void begin();
+  void loop();
+
+  /**
+   * Returns true once every stage, including the deferred ones, has been loaded.
+   */
+  bool isComplete() {
+    return _complete;
+  }
+
+  void readStatus(JsonObject& root);
+
+ private:
+  struct BootStage {
+    const char* name;
+    BootStageLoader loader;
+    bool deferred;
+    bool loaded;
+    unsigned long loadedAt;
+    unsigned long duration;
+  };
+
+  BootStage _stages[BOOT_SEQUENCE_MAX_STAGES];
+  uint8_t _count;
+  uint8_t _next;
+  BootCompleteCallback _callbacks[BOOT_SEQUENCE_MAX_CALLBACKS];
+  uint8_t _callbackCount;
+  bool _begun;
+  bool _complete;
+  unsigned long _completedAt;
+
+  void loadStage(BootStage& stage);
+  void bootStatus(AsyncWebServerRequest* request);
+};
+
+#endif  // end BootSequence_h
@@ -27,7 +27,71 @@ ESP8266React::ESP8266React(AsyncWebServer* server) :
 #endif
     _restartService(server, &_securitySettingsService),
     _factoryResetService(server, &ESPFS, &_securitySettingsService),
-    _systemStatus(server, &_securitySettingsService) {
+    _systemStatus(server, &_securitySettingsService),
+#if SETTINGS_STORE_ENABLED
+    _settingsStore(&ESPFS),
+#endif
+    _bootSequence(server, &_securitySettingsService),
+    _webSocketHub(server, &_securitySettingsService) {
+  // carry the framework's settings and status over the WebSocket hub
+  _webSocketHub.addChannel("wifiSettings", &_wifiSettingsService, WiFiSettings::read, WiFiSettings::update);
+  _webSocketHub.addChannel("apSettings", &_apSettingsService, APSettings::read, APSettings::update);
+#if FT_ENABLED(FT_NTP)
+  _webSocketHub.addChannel("ntpSettings", &_ntpSettingsService, NTPSettings::read, NTPSettings::update);
+#endif
+#if FT_ENABLED(FT_OTA)
+  _webSocketHub.addChannel("otaSettings", &_otaSettingsService, OTASettings::read, OTASettings::update);
+#endif
+#if FT_ENABLED(FT_MQTT)
+  _webSocketHub.addChannel("mqttSettings", &_mqttSettingsService, MqttSettings::read, MqttSettings::update);
+#endif
+#if FT_ENABLED(FT_SECURITY)
+  _webSocketHub.addChannel(
+      "securitySettings", &_securitySettingsService, SecuritySettings::read, SecuritySettings::update);
+#endif
+  _webSocketHub.addStatusChannel("wifiStatus", [this](JsonObject& root) { _wifiStatus.readStatus(root); });
+  _webSocketHub.addStatusChannel("apStatus", [this](JsonObject& root) { _apStatus.readStatus(root); });
+#if FT_ENABLED(FT_NTP)
+  _webSocketHub.addStatusChannel("ntpStatus", [this](JsonObject& root) { _ntpStatus.readStatus(root); });
+#endif
+#if FT_ENABLED(FT_MQTT)
+  _webSocketHub.addStatusChannel("mqttStatus", [this](JsonObject& root) { _mqttStatus.readStatus(root); });
+#endif
+  _webSocketHub.addStatusChannel("systemStatus", [this](JsonObject& root) { _systemStatus.readStatus(root); });
+  _webSocketHub.addStatusChannel("bootStatus", [this](JsonObject& root) { _bootSequence.readStatus(root); });
+
+  // WiFi/AP bring up networking, so they load first, the other services are loaded from the loop once the WiFi
+  // connection is under way
+  _bootSequence.addStage("filesystem", []() {
+#ifdef ESP32
+    ESPFS.begin(true);
+#elif defined(ESP8266)
+    ESPFS.begin();
+#endif
+  });
+#if SETTINGS_STORE_ENABLED
+  _bootSequence.addStage("settingsStore", [this]() {
+    _settingsStore.begin();
+    FSPersistenceBase::setSettingsStore(&_settingsStore);
+  });
+  // the log is held open while the settings are loaded at boot
+  _bootSequence.onComplete([this]() { _settingsStore.endBatch(); });
+#endif
+#if FT_ENABLED(FT_SECURITY)
+  _bootSequence.addStage("securitySettings", [this]() { _securitySettingsService.begin(); });
+#endif
+  _bootSequence.addStage("wifiSettings", [this]() { _wifiSettingsService.begin(); });
+  _bootSequence.addStage("apSettings", [this]() { _apSettingsService.begin(); });
+#if FT_ENABLED(FT_NTP)
+  _bootSequence.addStage("ntpSettings", [this]() { _ntpSettingsService.begin(); }, true);
+#endif
+#if FT_ENABLED(FT_OTA)
+  _bootSequence.addStage("otaSettings", [this]() { _otaSettingsService.begin(); }, true);
+#endif
+#if FT_ENABLED(FT_MQTT)
+  _bootSequence.addStage("mqttSettings", [this]() { _mqttSettingsService.begin(); }, true);
+#endif
+
 #ifdef PROGMEM_WWW
   // Serve static resources from PROGMEM
   WWWData::registerRoutes(
@@ -81,34 +145,22 @@ ESP8266React::ESP8266React(AsyncWebServer* server) :
 }
 
 void ESP8266React::begin() {
-#ifdef ESP32
-  ESPFS.begin(true);
-#elif defined(ESP8266)
-  ESPFS.begin();
-#endif
-  _wifiSettingsService.begin();
-  _apSettingsService.begin();
-#if FT_ENABLED(FT_NTP)
-  _ntpSettingsService.begin();
-#endif
-#if FT_ENABLED(FT_OTA)
-  _otaSettingsService.begin();
-#endif
-#if FT_ENABLED(FT_MQTT)
-  _mqttSettingsService.begin();
-#endif
-#if FT_ENABLED(FT_SECURITY)
-  _securitySettingsService.begin();
-#endif
+  _bootSequence.begin();
 }
 
 void ESP8266React::loop() {
   _wifiSettingsService.loop();
   _apSettingsService.loop();
+  _bootSequence.loop();
+  // deferred services are not serviced until they have loaded their settings
+  if (_bootSequence.isComplete()) {
 #if FT_ENABLED(FT_OTA)
-  _otaSettingsService.loop();
+    _otaSettingsService.loop();
 #endif
 #if FT_ENABLED(FT_MQTT)
-  _mqttSettingsService.loop();
+    _mqttSettingsService.loop();
 #endif
+  }
+  _webSocketHub.loop();
+  FSPersistenceBase::loopAll();
 }
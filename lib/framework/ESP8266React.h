@@ -12,6 +12,7 @@
 #endif
 
 #include <FeaturesService.h>
+#include <BootSequence.h>
 #include <APSettingsService.h>
 #include <APStatus.h>
 #include <AuthenticationService.h>
@@ -24,10 +25,12 @@
 #include <UploadFirmwareService.h>
 #include <RestartService.h>
 #include <SecuritySettingsService.h>
+#include <SettingsStore.h>
 #include <SystemStatus.h>
 #include <WiFiScanner.h>
 #include <WiFiSettingsService.h>
 #include <WiFiStatus.h>
+#include <WebSocketHub.h>
 #include <ESPFS.h>
 
 #ifdef PROGMEM_WWW
@@ -93,6 +96,14 @@ class ESP8266React {
     _factoryResetService.factoryReset();
   }
 
+  WebSocketHub* getWebSocketHub() {
+    return &_webSocketHub;
+  }
+
+  BootSequence* getBootSequence() {
+    return &_bootSequence;
+  }
+
  private:
   FeaturesService _featureService;
   SecuritySettingsService _securitySettingsService;
@@ -121,6 +132,11 @@ class ESP8266React {
   RestartService _restartService;
   FactoryResetService _factoryResetService;
   SystemStatus _systemStatus;
+#if SETTINGS_STORE_ENABLED
+  SettingsStore _settingsStore;
+#endif
+  BootSequence _bootSequence;
+  WebSocketHub _webSocketHub;
 };
 
 #endif
@@ -2,10 +2,33 @@
 #define FSPersistence_h
 
 #include <StatefulService.h>
-#include <FS.h>
+#include <FSPersistenceBase.h>
+#include <SettingsStore.h>
+
+#include <memory>
+
+// stored JSON is parsed into a document this many times its length, doubled on each retry while the parser runs out
+// of memory, the last attempt at eight times the length holds any JSON
+#ifndef FS_PERSISTENCE_JSON_EXPANSION
+#define FS_PERSISTENCE_JSON_EXPANSION 2
+#endif
+
+#define FS_PERSISTENCE_JSON_MAX_EXPANSION 8
+
+/**
+ * Encodes the state in a compact binary form, stored instead of JSON when a binary format is set.
+ */
+template <typename T>
+using BinaryStateWriter = std::function<void(T& settings, Print& out)>;
+
+/**
+ * Decodes a payload of the given length written by the matching BinaryStateWriter.
+ */
+template <typename T>
+using BinaryStateReader = std::function<StateUpdateResult(Stream& in, size_t length, T& settings)>;
 
 template <class T>
-class FSPersistence {
+class FSPersistence : public FSPersistenceBase {
  public:
   FSPersistence(JsonStateReader<T> stateReader,
                 JsonStateUpdater<T> stateUpdater,
@@ -19,30 +42,84 @@ class FSPersistence {
       _fs(fs),
       _filePath(filePath),
       _bufferSize(bufferSize),
-      _updateHandlerId(0) {
+      _updateHandlerId(0),
+      _quietPeriod(0),
+      _maxDelay(0),
+      _writePending(false),
+      _firstChange(0),
+      _lastChange(0),
+      _binaryFilePath(nullptr),
+      _schemaVersion(0),
+      _persistedHash({false, 0, 0}),
+      _readOverflowed(false) {
     enableUpdateHandler();
   }
 
+  /**
+   * Stores the state in a compact binary file, with a header holding the schema version and a checksum, rather than
+   * as JSON. The file is read back without a JSON parser, a file of another schema version is ignored. Settings found
+   * in the JSON file are converted on the next boot and the JSON file removed.
+   */
+  void setBinaryFormat(const char* binaryFilePath,
+                       uint16_t schemaVersion,
+                       BinaryStateWriter<T> binaryWriter,
+                       BinaryStateReader<T> binaryReader) {
+    _binaryFilePath = binaryFilePath;
+    _schemaVersion = schemaVersion;
+    _binaryWriter = binaryWriter;
+    _binaryReader = binaryReader;
+  }
+
+  /**
+   * Holds back writes until the state has been left alone for the quiet period (ms), or at most the maximum delay (ms)
+   * after the first unwritten change, coalescing bursts of updates into one write. Pending writes are made from the
+   * main loop rather than the context which updated the state. A quiet period of zero writes on every update.
+   */
+  void setWriteDelay(uint32_t quietPeriod, uint32_t maxDelay) {
+    _quietPeriod = quietPeriod;
+    _maxDelay = maxDelay < quietPeriod ? quietPeriod : maxDelay;
+  }
+
   void readFromFS() {
-    File settingsFile = _fs->open(_filePath, "r");
-
-    if (settingsFile) {
-      DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
-      DeserializationError error = deserializeJson(jsonDocument, settingsFile);
-      if (error == DeserializationError::Ok && jsonDocument.is<JsonObject>()) {
-        JsonObject jsonObject = jsonDocument.as<JsonObject>();
-        _statefulService->updateWithoutPropagation(jsonObject, _stateUpdater);
-        settingsFile.close();
-        return;
+    _readOverflowed = false;
+    SettingsStore* settingsStore = getSettingsStore();
+    if (settingsStore && readFromStore(settingsStore)) {
+      return;
+    }
+
+    // the file is rewritten, even if unchanged, unless it was read back as it stands, and files moved into the binary
+    // format or the settings store are removed once rewritten
+    bool recovered = false;
+    if (_binaryReader && readFiles(_binaryFilePath, &FSPersistence::readBinaryFile, recovered)) {
+      if (recovered || settingsStore) {
+        forgetPersisted();
+        if (writeToFS() && settingsStore) {
+          removeFile(_fs, _binaryFilePath);
+        }
       }
-      settingsFile.close();
+      return;
+    }
+    // settings saved as JSON, before the binary format was set, are converted
+    if (readFiles(_filePath, &FSPersistence::readFile, recovered)) {
+      bool moved = _binaryReader || settingsStore;
+      if (recovered || moved) {
+        forgetPersisted();
+        if (writeToFS() && moved) {
+          removeFile(_fs, _filePath);
+        }
+      }
+      return;
     }
 
     // If we reach here we have not been successful in loading the config and hard-coded defaults are now applied.
     // The settings are then written back to the file system so the defaults persist between resets. This last step is
     // required as in some cases defaults contain randomly generated values which would otherwise be modified on reset.
+    // Settings which could not be parsed for lack of memory are left on the file system rather than overwritten.
     applyDefaults();
-    writeToFS();
+    if (!_readOverflowed) {
+      forgetPersisted();
+      writeToFS();
+    }
   }
 
   //     void readFromFS() {
@@ -78,26 +155,28 @@ class FSPersistence {
   // }
 
   bool writeToFS() {
-    // create and populate a new json object
-    DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
-    JsonObject jsonObject = jsonDocument.to<JsonObject>();
-    _statefulService->read(jsonObject, _stateReader);
-
-    // make directories if required
-    mkdirs();
+    if (_binaryWriter) {
+      return writeBinaryToFS();
+    }
 
-    // serialize it to filesystem
-    File settingsFile = _fs->open(_filePath, "w");
+    // create and populate a new json object, sized to the state as it is read
+    std::unique_ptr<DynamicJsonDocument> jsonDocument;
+    _statefulService->read([&](T& settings) {
+      jsonDocument.reset(new DynamicJsonDocument(_statefulService->getJsonCapacity(_bufferSize)));
+      JsonObject jsonObject = jsonDocument->to<JsonObject>();
+      _stateReader(settings, jsonObject);
+    });
 
-    // failed to open file, return false
-    if (!settingsFile) {
+    // a truncated state is never written over the complete one
+    if (jsonDocument->overflowed()) {
+      Serial.printf_P(PSTR("Settings for %s overflowed their JSON buffer and were not written\r\n"), _filePath);
       return false;
     }
 
-    // serialize the data to the file
-    serializeJson(jsonDocument, settingsFile);
-    settingsFile.close();
-    return true;
+    // serialize it to filesystem, followed by its checksum, unless the same JSON is already there
+    ChecksumPrint measure;
+    serializeJson(*jsonDocument, measure);
+    return persist(_filePath, false, measure, [&](Print& out) { serializeJson(*jsonDocument, out); });
   }
 
   void disableUpdateHandler() {
@@ -109,7 +188,10 @@ class FSPersistence {
 
   void enableUpdateHandler() {
     if (!_updateHandlerId) {
-      _updateHandlerId = _statefulService->addUpdateHandler([&](const String& originId) { writeToFS(); });
+      _updateHandlerId = _statefulService->addUpdateHandler([&](const String& originId) { scheduleWrite(); });
+      if (!_updateHandlerId) {
+        Serial.printf_P(PSTR("Changes to %s will not be written\r\n"), _filePath);
+      }
     }
   }
 
@@ -121,25 +203,295 @@ class FSPersistence {
   const char* _filePath;
   size_t _bufferSize;
   update_handler_id_t _updateHandlerId;
+  uint32_t _quietPeriod;
+  uint32_t _maxDelay;
+  bool _writePending;
+  uint32_t _firstChange;
+  uint32_t _lastChange;
+  const char* _binaryFilePath;
+  uint16_t _schemaVersion;
+  BinaryStateWriter<T> _binaryWriter;
+  BinaryStateReader<T> _binaryReader;
+  ContentHash _persistedHash;
+  bool _readOverflowed;
 
-  // We assume we have a _filePath with format "/directory1/directory2/filename"
-  // We create a directory for each missing parent
-  void mkdirs() {
-    String path(_filePath);
-    int index = 0;
-    while ((index = path.indexOf('/', index + 1)) != -1) {
-      String segment = path.substring(0, index);
-      if (!_fs->exists(segment)) {
-        _fs->mkdir(segment);
+  void scheduleWrite() {
+    if (!_quietPeriod) {
+      writeToFS();
+      return;
+    }
+    lock();
+    uint32_t now = millis();
+    if (!_writePending) {
+      _writePending = true;
+      _firstChange = now;
+    }
+    _lastChange = now;
+    unlock();
+  }
+
+  void loop() {
+    lock();
+    uint32_t now = millis();
+    bool due = _writePending && ((uint32_t)(now - _lastChange) >= _quietPeriod ||
+                                 (uint32_t)(now - _firstChange) >= _maxDelay);
+    unlock();
+    if (due) {
+      flush();
+    }
+  }
+
+  void flush() {
+    lock();
+    bool pending = _writePending;
+    _writePending = false;
+    unlock();
+    if (pending) {
+      writeToFS();
+    }
+  }
+
+  void discard() {
+    lock();
+    _writePending = false;
+    unlock();
+  }
+
+  void forgetPersisted() {
+    lock();
+    _persistedHash.known = false;
+    unlock();
+  }
+
+  SettingsStore* getSettingsStore() {
+    return _settingsStore && _settingsStore->getFS() == _fs ? _settingsStore : nullptr;
+  }
+
+  /**
+   * Writes the content to the settings store or, failing that, replaces the file, framing the content with the binary
+   * header or the checksum trailer. Nothing is written if the measured content matches what was last persisted,
+   * sparing the flash an erase and write when an update serializes back to the same bytes. The hash is checked and
+   * recorded under the lock so it always describes the content as it stands.
+   */
+  bool persist(const char* path, bool binary, ChecksumPrint& measure, SettingsValueWriter writeContent) {
+    lock();
+    if (_persistedHash.matches(measure.length(), measure.checksum())) {
+      unlock();
+      return true;
+    }
+    bool written;
+    SettingsStore* settingsStore = getSettingsStore();
+    if (settingsStore) {
+      written = settingsStore->write(
+          path, binary ? _schemaVersion : 0, measure.length(), measure.checksum(), writeContent);
+    } else {
+      written = replaceFile(_fs, path, [&](Print& out) {
+        if (binary) {
+          writeBinaryHeader(out, _schemaVersion, measure.length(), measure.checksum());
+        }
+        ChecksumPrint content(&out);
+        writeContent(content);
+        bool complete = content.length() == measure.length() && content.checksum() == measure.checksum();
+        return binary ? complete && !content.failed() : complete && content.writeTrailer();
+      });
+    }
+    _persistedHash = {written, measure.length(), measure.checksum()};
+    unlock();
+    return written;
+  }
+
+  /**
+   * Reads the settings from the store, converting JSON kept there before the binary format was set.
+   */
+  bool readFromStore(SettingsStore* settingsStore) {
+    if (!_binaryReader) {
+      return readStoredJson(settingsStore);
+    }
+    if (readStoredBinary(settingsStore)) {
+      return true;
+    }
+    if (!readStoredJson(settingsStore)) {
+      return false;
+    }
+    forgetPersisted();
+    if (writeToFS()) {
+      settingsStore->remove(_filePath);
+    }
+    return true;
+  }
+
+  /**
+   * The JSON is parsed holding the file system lock, then applied once it is released, the state's lock must not be
+   * taken inside the file system lock.
+   */
+  bool readStoredJson(SettingsStore* settingsStore) {
+    std::unique_ptr<DynamicJsonDocument> jsonDocument;
+    ContentHash hash;
+    DeserializationError error = DeserializationError::Ok;
+    bool loaded = false;
+    for (size_t expansion = FS_PERSISTENCE_JSON_EXPANSION; expansion <= FS_PERSISTENCE_JSON_MAX_EXPANSION;
+         expansion *= 2) {
+      error = DeserializationError::Ok;
+      loaded = settingsStore->read(_filePath,
+                                   [&](Stream& in, size_t length, uint16_t version) {
+                                     // the document of the failed attempt is freed before the next is allocated
+                                     jsonDocument.reset();
+                                     jsonDocument.reset(new DynamicJsonDocument(readCapacity(length, expansion)));
+                                     error = deserializeJson(*jsonDocument, in);
+                                     return version == 0 && error == DeserializationError::Ok &&
+                                            jsonDocument->is<JsonObject>();
+                                   },
+                                   hash);
+      if (loaded || error != DeserializationError::NoMemory) {
+        break;
+      }
+    }
+    if (!loaded) {
+      if (error == DeserializationError::NoMemory) {
+        reportOverflow(_filePath);
+      }
+      return false;
+    }
+    JsonObject jsonObject = jsonDocument->as<JsonObject>();
+    _statefulService->updateWithoutPropagation(jsonObject, _stateUpdater);
+    setPersisted(hash);
+    return true;
+  }
+
+  bool readStoredBinary(SettingsStore* settingsStore) {
+    ContentHash hash;
+    bool loaded = _statefulService->updateWithoutPropagation([&](T& settings) {
+      StateUpdateResult result = StateUpdateResult::ERROR;
+      settingsStore->read(_binaryFilePath,
+                          [&](Stream& in, size_t length, uint16_t version) {
+                            if (version == _schemaVersion) {
+                              result = _binaryReader(in, length, settings);
+                            }
+                            return result != StateUpdateResult::ERROR;
+                          },
+                          hash);
+      return result;
+    }) != StateUpdateResult::ERROR;
+    if (loaded) {
+      setPersisted(hash);
+    }
+    return loaded;
+  }
+
+  bool readFile(const String& path) {
+    if (!_fs->exists(path)) {
+      return false;
+    }
+    File settingsFile = _fs->open(path, "r");
+    if (!settingsFile) {
+      return false;
+    }
+    bool loaded = false;
+    ContentHash hash;
+    if (verifyChecksum(settingsFile, hash)) {
+      DeserializationError error = DeserializationError::NoMemory;
+      for (size_t expansion = FS_PERSISTENCE_JSON_EXPANSION;
+           error == DeserializationError::NoMemory && expansion <= FS_PERSISTENCE_JSON_MAX_EXPANSION;
+           expansion *= 2) {
+        DynamicJsonDocument jsonDocument = DynamicJsonDocument(readCapacity(settingsFile.size(), expansion));
+        settingsFile.seek(0);
+        error = deserializeJson(jsonDocument, settingsFile);
+        if (error == DeserializationError::Ok && jsonDocument.is<JsonObject>()) {
+          JsonObject jsonObject = jsonDocument.as<JsonObject>();
+          _statefulService->updateWithoutPropagation(jsonObject, _stateUpdater);
+          loaded = true;
+          setPersisted(hash);
+        }
+      }
+      if (error == DeserializationError::NoMemory) {
+        reportOverflow(path);
+      }
+    }
+    settingsFile.close();
+    return loaded;
+  }
+
+  bool readBinaryFile(const String& path) {
+    if (!_fs->exists(path)) {
+      return false;
+    }
+    File settingsFile = _fs->open(path, "r");
+    if (!settingsFile) {
+      return false;
+    }
+    bool loaded = false;
+    ContentHash hash;
+    if (verifyBinaryHeader(settingsFile, _schemaVersion, hash)) {
+      loaded = _statefulService->updateWithoutPropagation([&](T& settings) {
+        return _binaryReader(settingsFile, hash.length, settings);
+      }) != StateUpdateResult::ERROR;
+      if (loaded) {
+        setPersisted(hash);
       }
     }
+    settingsFile.close();
+    return loaded;
+  }
+
+  /**
+   * Sizes the document stored JSON of the given length is parsed into. The state's capacity hint describes the state
+   * as it is now rather than as it was stored, so the document is sized from the stored length as well, never smaller
+   * than the document the state is written from.
+   */
+  size_t readCapacity(size_t length, size_t expansion) {
+    size_t capacity = _statefulService->getJsonCapacity(_bufferSize);
+    if (capacity < _bufferSize) {
+      capacity = _bufferSize;
+    }
+    return capacity > length * expansion ? capacity : length * expansion;
+  }
+
+  void reportOverflow(const String& path) {
+    _readOverflowed = true;
+    Serial.printf_P(PSTR("Settings in %s could not be parsed within %u times their length\r\n"),
+                    path.c_str(),
+                    FS_PERSISTENCE_JSON_MAX_EXPANSION);
+  }
+
+  void setPersisted(ContentHash& hash) {
+    lock();
+    _persistedHash = hash;
+    unlock();
+  }
+
+  /**
+   * Reads the file or, failing that, the temporary file or backup left by an interrupted write. A write interrupted
+   * between replacing the backup and the file leaves the new settings complete in the temporary file, failing that
+   * the backup holds the last settings known to be good.
+   */
+  bool readFiles(const String& path, bool (FSPersistence::*readOne)(const String& path), bool& recovered) {
+    recovered = false;
+    if ((this->*readOne)(path)) {
+      return true;
+    }
+    recovered = true;
+    return (this->*readOne)(path + FS_PERSISTENCE_TEMP_SUFFIX) || (this->*readOne)(path + FS_PERSISTENCE_BACKUP_SUFFIX);
+  }
+
+  /**
+   * Encodes the state twice under one read, first to size and checksum the payload for the header, so nothing larger
+   * than the file system's own buffers is held in memory.
+   */
+  bool writeBinaryToFS() {
+    bool written = false;
+    _statefulService->read([&](T& settings) {
+      ChecksumPrint measure;
+      _binaryWriter(settings, measure);
+      written = persist(_binaryFilePath, true, measure, [&](Print& out) { _binaryWriter(settings, out); });
+    });
+    return written;
   }
 
  protected:
   // We assume the updater supplies sensible defaults if an empty object
   // is supplied, this virtual function allows that to be changed.
   virtual void applyDefaults() {
-    DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
+    DynamicJsonDocument jsonDocument = DynamicJsonDocument(readCapacity(0, 0));
     JsonObject jsonObject = jsonDocument.as<JsonObject>();
     _statefulService->updateWithoutPropagation(jsonObject, _stateUpdater);
   }
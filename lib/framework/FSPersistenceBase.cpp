@@ -0,0 +1,262 @@
+#include <FSPersistenceBase.h>
+
+FSPersistenceBase* FSPersistenceBase::_first = nullptr;
+bool FSPersistenceBase::_writesSuspended = false;
+SettingsStore* FSPersistenceBase::_settingsStore = nullptr;
+
+FSPersistenceBase::FSPersistenceBase() : _next(_first) {
+  _first = this;
+}
+
+FSPersistenceBase::~FSPersistenceBase() {
+  for (FSPersistenceBase** persistence = &_first; *persistence; persistence = &(*persistence)->_next) {
+    if (*persistence == this) {
+      *persistence = _next;
+      break;
+    }
+  }
+}
+
+void FSPersistenceBase::loopAll() {
+  for (FSPersistenceBase* persistence = _first; persistence; persistence = persistence->_next) {
+    persistence->loop();
+  }
+}
+
+void FSPersistenceBase::flushAll() {
+  for (FSPersistenceBase* persistence = _first; persistence; persistence = persistence->_next) {
+    persistence->flush();
+  }
+}
+
+void FSPersistenceBase::discardAll() {
+  lock();
+  _writesSuspended = true;
+  for (FSPersistenceBase* persistence = _first; persistence; persistence = persistence->_next) {
+    persistence->discard();
+  }
+  unlock();
+}
+
+void FSPersistenceBase::setSettingsStore(SettingsStore* settingsStore) {
+  lock();
+  _settingsStore = settingsStore;
+  unlock();
+}
+
+uint32_t FSPersistenceBase::crc32(uint32_t crc, const uint8_t* data, size_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+bool FSPersistenceBase::verifyChecksum(File& file, ContentHash& hash) {
+  hash.known = false;
+  size_t size = file.size();
+  char trailer[FS_PERSISTENCE_CHECKSUM_LENGTH + 1];
+  if (size > FS_PERSISTENCE_CHECKSUM_LENGTH && file.seek(size - FS_PERSISTENCE_CHECKSUM_LENGTH) &&
+      file.read((uint8_t*)trailer, FS_PERSISTENCE_CHECKSUM_LENGTH) == FS_PERSISTENCE_CHECKSUM_LENGTH &&
+      trailer[0] == '\n') {
+    trailer[FS_PERSISTENCE_CHECKSUM_LENGTH] = '\0';
+    char* end;
+    uint32_t expected = strtoul(trailer + 1, &end, 16);
+    if (end == trailer + FS_PERSISTENCE_CHECKSUM_LENGTH) {
+      uint32_t checksum;
+      file.seek(0);
+      bool valid = checksumFile(file, size - FS_PERSISTENCE_CHECKSUM_LENGTH, checksum) && checksum == expected;
+      file.seek(0);
+      hash = {valid, size - FS_PERSISTENCE_CHECKSUM_LENGTH, checksum};
+      return valid;
+    }
+  }
+  file.seek(0);
+  return true;
+}
+
+bool FSPersistenceBase::verifyBinaryHeader(File& file, uint16_t schemaVersion, ContentHash& hash) {
+  hash.known = false;
+  uint8_t header[FS_PERSISTENCE_BINARY_HEADER_LENGTH];
+  if (file.read(header, sizeof(header)) != sizeof(header) || memcmp(header, FS_PERSISTENCE_BINARY_MAGIC, 4) != 0) {
+    return false;
+  }
+  uint16_t version = header[4] | (header[5] << 8);
+  uint32_t length = (uint32_t)header[8] | ((uint32_t)header[9] << 8) | ((uint32_t)header[10] << 16) |
+           ((uint32_t)header[11] << 24);
+  uint32_t expected = (uint32_t)header[12] | ((uint32_t)header[13] << 8) | ((uint32_t)header[14] << 16) |
+                      ((uint32_t)header[15] << 24);
+  uint32_t checksum;
+  if (version != schemaVersion || file.size() != FS_PERSISTENCE_BINARY_HEADER_LENGTH + length ||
+      !checksumFile(file, length, checksum) || checksum != expected) {
+    return false;
+  }
+  hash = {true, length, checksum};
+  return file.seek(FS_PERSISTENCE_BINARY_HEADER_LENGTH);
+}
+
+void FSPersistenceBase::writeBinaryHeader(Print& out, uint16_t schemaVersion, uint32_t length, uint32_t checksum) {
+  uint8_t header[FS_PERSISTENCE_BINARY_HEADER_LENGTH] = {0};
+  memcpy(header, FS_PERSISTENCE_BINARY_MAGIC, 4);
+  for (size_t i = 0; i < 2; i++) {
+    header[4 + i] = schemaVersion >> (8 * i);
+  }
+  for (size_t i = 0; i < 4; i++) {
+    header[8 + i] = length >> (8 * i);
+    header[12 + i] = checksum >> (8 * i);
+  }
+  out.write(header, sizeof(header));
+}
+
+bool FSPersistenceBase::replaceFile(FS* fs, const String& path, std::function<bool(Print& out)> writeContent) {
+  lock();
+
+  // the configuration is being deleted
+  if (_writesSuspended) {
+    unlock();
+    return false;
+  }
+
+  // make directories if required
+  mkdirs(fs, path);
+
+  String tempPath = path + FS_PERSISTENCE_TEMP_SUFFIX;
+  File file = fs->open(tempPath, "w");
+
+  // failed to open file, return false
+  if (!file) {
+    unlock();
+    return false;
+  }
+
+  bool written = writeContent(file);
+  // the file system has no fsync, closing the file commits it to flash before the rename
+  file.flush();
+  file.close();
+  if (!written) {
+    fs->remove(tempPath);
+    unlock();
+    return false;
+  }
+
+  bool replaced = moveTempFile(fs, path);
+  unlock();
+  return replaced;
+}
+
+bool FSPersistenceBase::beginStagedFile(FS* fs, const String& path) {
+  lock();
+  if (_writesSuspended) {
+    unlock();
+    return false;
+  }
+  mkdirs(fs, path);
+  File file = fs->open(path + FS_PERSISTENCE_TEMP_SUFFIX, "w");
+  bool opened = (bool)file;
+  if (opened) {
+    file.close();
+  }
+  unlock();
+  return opened;
+}
+
+bool FSPersistenceBase::appendStagedFile(FS* fs, const String& path, const uint8_t* data, size_t length) {
+  lock();
+  if (_writesSuspended) {
+    unlock();
+    return false;
+  }
+  File file = fs->open(path + FS_PERSISTENCE_TEMP_SUFFIX, "a");
+  bool written = false;
+  if (file) {
+    written = file.write(data, length) == length;
+    file.close();
+  }
+  unlock();
+  return written;
+}
+
+bool FSPersistenceBase::commitStagedFile(FS* fs, const String& path) {
+  lock();
+  bool replaced = !_writesSuspended && fs->exists(path + FS_PERSISTENCE_TEMP_SUFFIX) && moveTempFile(fs, path);
+  unlock();
+  return replaced;
+}
+
+void FSPersistenceBase::abortStagedFile(FS* fs, const String& path) {
+  lock();
+  String tempPath = path + FS_PERSISTENCE_TEMP_SUFFIX;
+  if (fs->exists(tempPath)) {
+    fs->remove(tempPath);
+  }
+  unlock();
+}
+
+/**
+ * Keeps the previous file as the backup, then moves the complete temporary file into place. Called holding the lock.
+ */
+bool FSPersistenceBase::moveTempFile(FS* fs, const String& path) {
+  String backupPath = path + FS_PERSISTENCE_BACKUP_SUFFIX;
+  if (fs->exists(path)) {
+    fs->remove(backupPath);
+    fs->rename(path, backupPath);
+  }
+  return fs->rename(path + FS_PERSISTENCE_TEMP_SUFFIX, path);
+}
+
+void FSPersistenceBase::removeFile(FS* fs, const String& path) {
+  lock();
+  const char* suffixes[] = {"", FS_PERSISTENCE_TEMP_SUFFIX, FS_PERSISTENCE_BACKUP_SUFFIX};
+  for (const char* suffix : suffixes) {
+    if (fs->exists(path + suffix)) {
+      fs->remove(path + suffix);
+    }
+  }
+  unlock();
+}
+
+bool FSPersistenceBase::checksumFile(File& file, size_t length, uint32_t& checksum) {
+  checksum = 0;
+  uint8_t block[64];
+  while (length) {
+    size_t read = file.read(block, length < sizeof(block) ? length : sizeof(block));
+    if (!read) {
+      return false;
+    }
+    checksum = crc32(checksum, block, read);
+    length -= read;
+  }
+  return true;
+}
+
+void FSPersistenceBase::mkdirs(FS* fs, const String& path) {
+  int index = 0;
+  while ((index = path.indexOf('/', index + 1)) != -1) {
+    String segment = path.substring(0, index);
+    if (!fs->exists(segment)) {
+      fs->mkdir(segment);
+    }
+  }
+}
+
+#ifdef ESP32
+static SemaphoreHandle_t fsPersistenceMutex() {
+  static SemaphoreHandle_t mutex = xSemaphoreCreateRecursiveMutex();
+  return mutex;
+}
+#endif
+
+void FSPersistenceBase::lock() {
+#ifdef ESP32
+  xSemaphoreTakeRecursive(fsPersistenceMutex(), portMAX_DELAY);
+#endif
+}
+
+void FSPersistenceBase::unlock() {
+#ifdef ESP32
+  xSemaphoreGiveRecursive(fsPersistenceMutex());
+#endif
+}
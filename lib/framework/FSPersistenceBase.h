@@ -0,0 +1,187 @@
+#ifndef FSPersistenceBase_h
+#define FSPersistenceBase_h
+
+#include <Arduino.h>
+#include <FS.h>
+
+#include <functional>
+
+// settings are written to a temporary file which replaces the settings file once complete, the previous settings
+// file is kept as a backup
+#define FS_PERSISTENCE_TEMP_SUFFIX ".tmp"
+#define FS_PERSISTENCE_BACKUP_SUFFIX ".bak"
+
+// written after the JSON: a newline followed by the CRC-32 of the JSON as 8 hex digits
+#define FS_PERSISTENCE_CHECKSUM_LENGTH 9
+
+// binary files start with the magic, the schema version (2 bytes), 2 reserved bytes, then the length and the CRC-32 of
+// the payload (4 bytes each), all little endian
+#define FS_PERSISTENCE_BINARY_MAGIC "FSPB"
+#define FS_PERSISTENCE_BINARY_HEADER_LENGTH 16
+
+class SettingsStore;
+
+/**
+ * Links every FSPersistence so writes held back by a write delay can be flushed from the main loop and before the
+ * device restarts, or dropped before the configuration is deleted.
+ */
+class FSPersistenceBase {
+ public:
+  /**
+   * Flushes the pending writes which are due, called from the main loop.
+   */
+  static void loopAll();
+
+  /**
+   * Flushes every pending write immediately.
+   */
+  static void flushAll();
+
+  /**
+   * Drops every pending write and refuses further writes until restart, so deleted settings are not written back.
+   */
+  static void discardAll();
+
+  /**
+   * Directs every FSPersistence on the store's file system to keep its settings in the store rather than in a file of
+   * its own. Settings found in the files are moved into the store as they are next read.
+   */
+  static void setSettingsStore(SettingsStore* settingsStore);
+
+  static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t len);
+
+  /**
+   * The length and CRC-32 of the content last known to be on flash, so writing identical content can be skipped.
+   */
+  struct ContentHash {
+    bool known;
+    size_t length;
+    uint32_t checksum;
+
+    bool matches(size_t otherLength, uint32_t otherChecksum) {
+      return known && length == otherLength && checksum == otherChecksum;
+    }
+  };
+
+  /**
+   * Returns false if the file ends with a checksum which does not match its content. Files written before checksums
+   * were introduced are accepted, leaving the JSON parser to reject truncation. Leaves the file at its start. The hash
+   * of the content is known only if the file has a checksum.
+   */
+  static bool verifyChecksum(File& file, ContentHash& hash);
+
+  /**
+   * Returns true if the file holds a complete binary payload of the schema version, leaving the file at the start of
+   * the payload. The hash is that of the payload.
+   */
+  static bool verifyBinaryHeader(File& file, uint16_t schemaVersion, ContentHash& hash);
+
+  static void writeBinaryHeader(Print& out, uint16_t schemaVersion, uint32_t length, uint32_t checksum);
+
+  /**
+   * Replaces the file with the content written by the callback. The content goes to a temporary file which is renamed
+   * into place once complete, keeping the previous file as a backup, so an interrupted write never leaves a truncated
+   * file. The temporary file is flushed and closed before the rename, there is no fsync: the content is on flash once
+   * the file system has committed the close. Returns false, leaving the file untouched, if the callback fails or writes
+   * are suspended.
+   */
+  static bool replaceFile(FS* fs, const String& path, std::function<bool(Print& out)> writeContent);
+
+  /**
+   * Replaces the file with content appended over many calls, for content too large to produce at once. The content is
+   * staged in the temporary file: beginStagedFile() truncates it, appendStagedFile() adds to it and commitStagedFile()
+   * moves it into place as replaceFile() does. abortStagedFile() drops it, leaving the file untouched.
+   */
+  static bool beginStagedFile(FS* fs, const String& path);
+  static bool appendStagedFile(FS* fs, const String& path, const uint8_t* data, size_t length);
+  static bool commitStagedFile(FS* fs, const String& path);
+  static void abortStagedFile(FS* fs, const String& path);
+
+  /**
+   * Removes the file along with its temporary file and backup.
+   */
+  static void removeFile(FS* fs, const String& path);
+
+  /**
+   * Passes writes on, if given somewhere to write to, while computing the length and checksum of the content.
+   */
+  class ChecksumPrint : public Print {
+   public:
+    ChecksumPrint(Print* out = nullptr) : _out(out), _checksum(0), _length(0), _failed(false) {
+    }
+
+    size_t write(uint8_t c) {
+      return write(&c, 1);
+    }
+
+    size_t write(const uint8_t* data, size_t len) {
+      size_t written = _out ? _out->write(data, len) : len;
+      _failed |= written != len;
+      _checksum = crc32(_checksum, data, written);
+      _length += written;
+      return written;
+    }
+
+    uint32_t checksum() {
+      return _checksum;
+    }
+
+    size_t length() {
+      return _length;
+    }
+
+    bool failed() {
+      return _failed;
+    }
+
+    /**
+     * Appends the checksum as a text trailer, returns false if any write fell short.
+     */
+    bool writeTrailer() {
+      char trailer[FS_PERSISTENCE_CHECKSUM_LENGTH + 1];
+      snprintf(trailer, sizeof(trailer), "\n%08x", _checksum);
+      return _out->write((const uint8_t*)trailer, FS_PERSISTENCE_CHECKSUM_LENGTH) == FS_PERSISTENCE_CHECKSUM_LENGTH &&
+             !_failed;
+    }
+
+   private:
+    Print* _out;
+    uint32_t _checksum;
+    size_t _length;
+    bool _failed;
+  };
+
+ protected:
+  FSPersistenceBase();
+  virtual ~FSPersistenceBase();
+
+  virtual void loop() = 0;
+  virtual void flush() = 0;
+  virtual void discard() = 0;
+
+  static bool writesSuspended() {
+    return _writesSuspended;
+  }
+
+  // serializes file system writes between the main loop and the async web server
+  static void lock();
+  static void unlock();
+
+  static SettingsStore* _settingsStore;
+
+ private:
+  friend class SettingsStore;
+
+  static bool checksumFile(File& file, size_t length, uint32_t& checksum);
+  static bool moveTempFile(FS* fs, const String& path);
+
+  // We assume we have a path with format "/directory1/directory2/filename"
+  // We create a directory for each missing parent
+  static void mkdirs(FS* fs, const String& path);
+
+  static FSPersistenceBase* _first;
+  static bool _writesSuspended;
+  FSPersistenceBase* _next;
+};
+
+#endif  // end FSPersistenceBase_h
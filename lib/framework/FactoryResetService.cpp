@@ -18,6 +18,8 @@ void FactoryResetService::handleRequest(AsyncWebServerRequest* request) {
  * Delete function assumes that all files are stored flat, within the config directory.
  */
 void FactoryResetService::factoryReset() {
+  // pending or later writes would recreate the deleted settings
+  FSPersistenceBase::discardAll();
 #ifdef ESP32
   File root = fs->open(FS_CONFIG_DIRECTORY);
   File file;
@@ -2,15 +2,81 @@
 #define HttpEndpoint_h
 
 #include <functional>
+#include <memory>
 
 #include <AsyncJson.h>
 #include <ESPAsyncWebServer.h>
 
+#include <JsonStateStreamer.h>
+#include <JsonStreamParser.h>
+#include <JsonUtils.h>
 #include <SecurityManager.h>
 #include <StatefulService.h>
 
 #define HTTP_ENDPOINT_ORIGIN_ID "http"
 
+#define ETAG_HEADER "ETag"
+#define IF_NONE_MATCH_HEADER "If-None-Match"
+#define CACHE_CONTROL_HEADER "Cache-Control"
+
+// streamed updates in progress at once, each holds a parser and a state builder until its body is complete
+#ifndef HTTP_ENDPOINT_MAX_STREAM_UPDATES
+#define HTTP_ENDPOINT_MAX_STREAM_UPDATES 2
+#endif
+
+/**
+ * Formats the ETag for a state version. Versions restart from zero on boot so the tag includes a random boot id,
+ * preventing a response cached before a restart from being validated against a different state.
+ */
+inline String versionETag(uint32_t version) {
+#ifdef ESP32
+  static const uint32_t bootId = esp_random();
+#elif defined(ESP8266)
+  static const uint32_t bootId = RANDOM_REG32;
+#else
+  static const uint32_t bootId = micros();
+#endif
+  return "\"" + String(bootId, HEX) + "-" + String(version) + "\"";
+}
+
+/**
+ * A JSON response sized to the state by the service's capacity hint, which can tell when the state did not fit.
+ */
+class JsonStateResponse : public AsyncJsonResponse {
+ public:
+  /**
+   * The response's root object is nested in the document's root array, which takes a slot in addition to the state.
+   */
+  JsonStateResponse(size_t capacity) : AsyncJsonResponse(false, JSON_ARRAY_SIZE(1) + capacity) {
+  }
+
+  bool overflowed() {
+    return _jsonBuffer.overflowed();
+  }
+
+  /**
+   * Reads the state into a new response, sized and filled under one lock. Returns nullptr rather than a truncated
+   * state if it overflowed.
+   */
+  template <class T>
+  static JsonStateResponse* read(StatefulService<T>* statefulService,
+                                 JsonStateReader<T> stateReader,
+                                 size_t bufferSize) {
+    JsonStateResponse* response = nullptr;
+    statefulService->read([&](T& settings) {
+      response = new JsonStateResponse(statefulService->getJsonCapacity(bufferSize));
+      JsonObject root = response->getRoot().to<JsonObject>();
+      stateReader(settings, root);
+    });
+    if (response->overflowed()) {
+      delete response;
+      return nullptr;
+    }
+    response->setLength();
+    return response;
+  }
+};
+
 template <class T>
 class HttpGetEndpoint {
  public:
@@ -37,21 +103,165 @@ class HttpGetEndpoint {
     server->on(servicePath.c_str(), HTTP_GET, std::bind(&HttpGetEndpoint::fetchSettings, this, std::placeholders::_1));
   }
 
+  /**
+   * Serves the state as a chunked response produced by the streamer, rather than from a single document of the
+   * endpoint's buffer size. The buffer size then only needs to hold the largest element.
+   */
+  void setStateStreamer(JsonStateStreamer<T> stateStreamer) {
+    _stateStreamer = stateStreamer;
+  }
+
  protected:
   JsonStateReader<T> _stateReader;
   StatefulService<T>* _statefulService;
   size_t _bufferSize;
+  JsonStateStreamer<T> _stateStreamer;
 
+  /**
+   * Serves the state with an ETag derived from the service's version. Requests revalidating an unchanged state are
+   * answered with 304 without locking or serializing the state.
+   */
   void fetchSettings(AsyncWebServerRequest* request) {
-    AsyncJsonResponse* response = new AsyncJsonResponse(false, _bufferSize);
-    JsonObject jsonObject = response->getRoot().to<JsonObject>();
-    _statefulService->read(jsonObject, _stateReader);
+    String etag = versionETag(_statefulService->getVersion());
+    if (request->hasHeader(IF_NONE_MATCH_HEADER) && request->getHeader(IF_NONE_MATCH_HEADER)->value() == etag) {
+      AsyncWebServerResponse* response = request->beginResponse(304);
+      response->addHeader(ETAG_HEADER, etag);
+      request->send(response);
+      return;
+    }
 
-    response->setLength();
+    if (_stateStreamer) {
+      AsyncWebServerResponse* response = _stateStreamer.beginResponse(request, _statefulService, _bufferSize);
+      response->addHeader(ETAG_HEADER, etag);
+      response->addHeader(CACHE_CONTROL_HEADER, "no-cache");
+      request->send(response);
+      return;
+    }
+
+    JsonStateResponse* response = JsonStateResponse::read(_statefulService, _stateReader, _bufferSize);
+    if (!response) {
+      request->send(500);
+      return;
+    }
+
+    // the version is taken before reading, a state changed in between is served again on the next request
+    response->addHeader(ETAG_HEADER, etag);
+    response->addHeader(CACHE_CONTROL_HEADER, "no-cache");
     request->send(response);
   }
 };
 
+/**
+ * Parses POST bodies as they arrive, feeding the elements of one array member into a JsonStateBuilder created for the
+ * request. Memory use is bounded by the buffer size and the builder, not by the size of the body.
+ */
+template <class T>
+class HttpStreamUpdater {
+ public:
+  HttpStreamUpdater(JsonStateBuilderFactory<T> stateBuilderFactory,
+                    const char* arrayKey,
+                    StatefulService<T>* statefulService,
+                    ArRequestFilterFunction authenticationFilter,
+                    size_t bufferSize) :
+      _stateBuilderFactory(stateBuilderFactory),
+      _arrayKey(arrayKey),
+      _statefulService(statefulService),
+      _authenticationFilter(authenticationFilter),
+      _bufferSize(bufferSize) {
+  }
+
+  void handleBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+    StreamUpdate* update = index ? find(request) : begin(request);
+    if (update) {
+      update->parser->parse(data, len);
+    }
+  }
+
+  /**
+   * Applies the update once the body is complete. On error the response is sent here and ERROR is returned.
+   */
+  StateUpdateResult complete(AsyncWebServerRequest* request) {
+    if (_authenticationFilter && !_authenticationFilter(request)) {
+      request->send(401);
+      return StateUpdateResult::ERROR;
+    }
+    StreamUpdate* update = find(request);
+    if (!update) {
+      // a body without an update had no free slot
+      request->send(request->contentLength() ? 503 : 400);
+      return StateUpdateResult::ERROR;
+    }
+    DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
+    JsonStreamError error = update->parser->finish(jsonDocument);
+    StateUpdateResult outcome = StateUpdateResult::ERROR;
+    if (error == JsonStreamError::NONE && jsonDocument.is<JsonObject>()) {
+      JsonObject root = jsonDocument.as<JsonObject>();
+      JsonStateBuilder<T>* builder = update->builder.get();
+      outcome = _statefulService->updateWithoutPropagation(
+          [&](T& settings) { return builder->apply(root, settings); });
+    }
+    release(request);
+    if (outcome == StateUpdateResult::ERROR) {
+      request->send(error == JsonStreamError::TOO_LARGE ? 413 : 400);
+    }
+    return outcome;
+  }
+
+ private:
+  struct StreamUpdate {
+    AsyncWebServerRequest* request = nullptr;
+    std::unique_ptr<JsonStateBuilder<T>> builder;
+    std::unique_ptr<JsonStreamParser> parser;
+  };
+
+  JsonStateBuilderFactory<T> _stateBuilderFactory;
+  const char* _arrayKey;
+  StatefulService<T>* _statefulService;
+  ArRequestFilterFunction _authenticationFilter;
+  size_t _bufferSize;
+  StreamUpdate _updates[HTTP_ENDPOINT_MAX_STREAM_UPDATES];
+
+  StreamUpdate* begin(AsyncWebServerRequest* request) {
+    if (_authenticationFilter && !_authenticationFilter(request)) {
+      return nullptr;
+    }
+    for (StreamUpdate& update : _updates) {
+      if (!update.request) {
+        JsonStateBuilder<T>* builder = _stateBuilderFactory();
+        update.request = request;
+        update.builder.reset(builder);
+        update.parser.reset(new JsonStreamParser(
+            _arrayKey,
+            _bufferSize,
+            [builder]() { builder->beginElements(); },
+            [builder](JsonObject& element) { return builder->addElement(element); }));
+        // frees the update if the client goes away before the body is complete
+        request->onDisconnect([this, request]() { release(request); });
+        return &update;
+      }
+    }
+    return nullptr;
+  }
+
+  StreamUpdate* find(AsyncWebServerRequest* request) {
+    for (StreamUpdate& update : _updates) {
+      if (update.request == request) {
+        return &update;
+      }
+    }
+    return nullptr;
+  }
+
+  void release(AsyncWebServerRequest* request) {
+    StreamUpdate* update = find(request);
+    if (update) {
+      update->parser.reset();
+      update->builder.reset();
+      update->request = nullptr;
+    }
+  }
+};
+
 template <class T>
 class HttpPostEndpoint {
  public:
@@ -72,8 +282,11 @@ class HttpPostEndpoint {
               std::bind(&HttpPostEndpoint::updateSettings, this, std::placeholders::_1, std::placeholders::_2),
               authenticationPredicate),
           bufferSize),
-      _bufferSize(bufferSize) {
-    _updateHandler.setMethod(HTTP_POST);
+      _bufferSize(bufferSize),
+      _server(server),
+      _servicePath(servicePath),
+      _authenticationFilter(securityManager->filterRequest(authenticationPredicate)) {
+    _updateHandler.setMethod(HTTP_POST | HTTP_PATCH);
     server->addHandler(&_updateHandler);
   }
 
@@ -89,17 +302,56 @@ class HttpPostEndpoint {
       _updateHandler(servicePath,
                      std::bind(&HttpPostEndpoint::updateSettings, this, std::placeholders::_1, std::placeholders::_2),
                      bufferSize),
-      _bufferSize(bufferSize) {
-    _updateHandler.setMethod(HTTP_POST);
+      _bufferSize(bufferSize),
+      _server(server),
+      _servicePath(servicePath) {
+    _updateHandler.setMethod(HTTP_POST | HTTP_PATCH);
     server->addHandler(&_updateHandler);
   }
 
+  /**
+   * Responds to updates with a chunked response produced by the streamer.
+   */
+  void setStateStreamer(JsonStateStreamer<T> stateStreamer) {
+    _stateStreamer = stateStreamer;
+  }
+
+  /**
+   * Parses updates as the body arrives rather than buffering the whole body into a document of the endpoint's buffer
+   * size. The elements of the array member are fed one at a time to a builder created for each request, which applies
+   * the update once the body is complete. Replaces the state updater for POST, PATCH still uses it.
+   */
+  void setStateBuilder(const char* arrayKey, JsonStateBuilderFactory<T> stateBuilderFactory) {
+    if (_streamUpdater) {
+      return;
+    }
+    _streamUpdater.reset(new HttpStreamUpdater<T>(
+        stateBuilderFactory, arrayKey, _statefulService, _authenticationFilter, _bufferSize));
+    _updateHandler.setMethod(HTTP_PATCH);
+    _server->on(_servicePath.c_str(),
+                HTTP_POST,
+                std::bind(&HttpPostEndpoint::updateStreamedSettings, this, std::placeholders::_1),
+                nullptr,
+                std::bind(&HttpStreamUpdater<T>::handleBody,
+                          _streamUpdater.get(),
+                          std::placeholders::_1,
+                          std::placeholders::_2,
+                          std::placeholders::_3,
+                          std::placeholders::_4,
+                          std::placeholders::_5));
+  }
+
  protected:
   JsonStateReader<T> _stateReader;
   JsonStateUpdater<T> _stateUpdater;
   StatefulService<T>* _statefulService;
   AsyncCallbackJsonWebHandler _updateHandler;
   size_t _bufferSize;
+  JsonStateStreamer<T> _stateStreamer;
+  AsyncWebServer* _server;
+  String _servicePath;
+  ArRequestFilterFunction _authenticationFilter;
+  std::unique_ptr<HttpStreamUpdater<T>> _streamUpdater;
 
   void updateSettings(AsyncWebServerRequest* request, JsonVariant& json) {
     if (!json.is<JsonObject>()) {
@@ -107,6 +359,10 @@ class HttpPostEndpoint {
       return;
     }
     JsonObject jsonObject = json.as<JsonObject>();
+    if (request->method() == HTTP_PATCH) {
+      patchSettings(request, jsonObject);
+      return;
+    }
     StateUpdateResult outcome = _statefulService->updateWithoutPropagation(jsonObject, _stateUpdater);
     if (outcome == StateUpdateResult::ERROR) {
       request->send(400);
@@ -115,12 +371,74 @@ class HttpPostEndpoint {
     if (outcome == StateUpdateResult::CHANGED) {
       request->onDisconnect([this]() { _statefulService->callUpdateHandlers(HTTP_ENDPOINT_ORIGIN_ID); });
     }
-    AsyncJsonResponse* response = new AsyncJsonResponse(false, _bufferSize);
-    jsonObject = response->getRoot().to<JsonObject>();
-    _statefulService->read(jsonObject, _stateReader);
+    sendSettings(request);
+  }
+
+  /**
+   * Applies the body as an RFC 7386 merge patch. The state is read, patched and passed to the state updater under the
+   * service's lock, so members absent from the patch keep their values. Responds with the resulting values of the
+   * patched members only.
+   */
+  void patchSettings(AsyncWebServerRequest* request, JsonObject& patch) {
+    // the patch may add members to the state, and its keys are copied when it does
+    size_t capacity = _statefulService->getJsonCapacity(_bufferSize) + patch.memoryUsage();
+    DynamicJsonDocument jsonDocument = DynamicJsonDocument(capacity);
+    bool overflowed = false;
+    StateUpdateResult outcome = _statefulService->updateWithoutPropagation([&](T& settings) {
+      JsonObject root = jsonDocument.to<JsonObject>();
+      _stateReader(settings, root);
+      JsonUtils::mergePatch(root, patch);
+      // a truncated state would be written back without its missing members
+      if (jsonDocument.overflowed()) {
+        overflowed = true;
+        return StateUpdateResult::ERROR;
+      }
+      return _stateUpdater(root, settings);
+    });
+    if (outcome == StateUpdateResult::ERROR) {
+      request->send(overflowed ? 413 : 400);
+      return;
+    }
+    if (outcome == StateUpdateResult::CHANGED) {
+      request->onDisconnect([this]() { _statefulService->callUpdateHandlers(HTTP_ENDPOINT_ORIGIN_ID); });
+    }
+    JsonStateResponse* response = new JsonStateResponse(capacity);
+    JsonObject delta = response->getRoot().to<JsonObject>();
+    JsonObject root = jsonDocument.to<JsonObject>();
+    _statefulService->read(root, _stateReader);
+    JsonUtils::projectPatch(root, patch, delta);
+    if (jsonDocument.overflowed() || response->overflowed()) {
+      delete response;
+      request->send(500);
+      return;
+    }
     response->setLength();
     request->send(response);
   }
+
+  void updateStreamedSettings(AsyncWebServerRequest* request) {
+    StateUpdateResult outcome = _streamUpdater->complete(request);
+    if (outcome == StateUpdateResult::ERROR) {
+      return;
+    }
+    if (outcome == StateUpdateResult::CHANGED) {
+      request->onDisconnect([this]() { _statefulService->callUpdateHandlers(HTTP_ENDPOINT_ORIGIN_ID); });
+    }
+    sendSettings(request);
+  }
+
+  void sendSettings(AsyncWebServerRequest* request) {
+    if (_stateStreamer) {
+      request->send(_stateStreamer.beginResponse(request, _statefulService, _bufferSize));
+      return;
+    }
+    JsonStateResponse* response = JsonStateResponse::read(_statefulService, _stateReader, _bufferSize);
+    if (!response) {
+      request->send(500);
+      return;
+    }
+    request->send(response);
+  }
 };
 
 template <class T>
@@ -160,6 +478,11 @@ class HttpEndpoint : public HttpGetEndpoint<T>, public HttpPostEndpoint<T> {
       HttpGetEndpoint<T>(stateReader, statefulService, server, servicePath, bufferSize),
       HttpPostEndpoint<T>(stateReader, stateUpdater, statefulService, server, servicePath, bufferSize) {
   }
+
+  void setStateStreamer(JsonStateStreamer<T> stateStreamer) {
+    HttpGetEndpoint<T>::setStateStreamer(stateStreamer);
+    HttpPostEndpoint<T>::setStateStreamer(stateStreamer);
+  }
 };
 
 #endif  // end HttpEndpoint
@@ -0,0 +1,133 @@
+#ifndef InplaceFunction_h
+#define InplaceFunction_h
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+#ifndef INPLACE_FUNCTION_CAPACITY
+#define INPLACE_FUNCTION_CAPACITY (4 * sizeof(void*))
+#endif
+
+template <typename Signature, size_t Capacity = INPLACE_FUNCTION_CAPACITY>
+class InplaceFunction;
+
+/**
+ * A drop-in replacement for std::function which stores the callable in a fixed size internal buffer and therefore
+ * never allocates. Callables which do not fit in the buffer are rejected at compile time rather than spilling to the
+ * heap.
+ *
+ * Typical callables used by the framework are lambdas capturing "this" or a pointer or two, which fit comfortably.
+ */
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity> {
+ public:
+  InplaceFunction() : _ops(nullptr) {
+  }
+
+  InplaceFunction(std::nullptr_t) : _ops(nullptr) {
+  }
+
+  template <typename F,
+            typename Callable = typename std::decay<F>::type,
+            typename = typename std::enable_if<!std::is_same<Callable, InplaceFunction>::value>::type>
+  InplaceFunction(F&& f) : _ops(&Manager<Callable>::ops()) {
+    static_assert(sizeof(Callable) <= Capacity, "Callable is too large for InplaceFunction, increase the capacity");
+    static_assert(alignof(Callable) <= alignof(Storage), "Callable alignment is not supported by InplaceFunction");
+    new (&_storage) Callable(std::forward<F>(f));
+  }
+
+  InplaceFunction(const InplaceFunction& other) : _ops(other._ops) {
+    if (_ops) {
+      _ops->copy(&_storage, &other._storage);
+    }
+  }
+
+  InplaceFunction(InplaceFunction&& other) : _ops(other._ops) {
+    if (_ops) {
+      _ops->move(&_storage, &other._storage);
+    }
+  }
+
+  ~InplaceFunction() {
+    reset();
+  }
+
+  InplaceFunction& operator=(const InplaceFunction& other) {
+    if (this != &other) {
+      reset();
+      _ops = other._ops;
+      if (_ops) {
+        _ops->copy(&_storage, &other._storage);
+      }
+    }
+    return *this;
+  }
+
+  InplaceFunction& operator=(InplaceFunction&& other) {
+    if (this != &other) {
+      reset();
+      _ops = other._ops;
+      if (_ops) {
+        _ops->move(&_storage, &other._storage);
+      }
+    }
+    return *this;
+  }
+
+  InplaceFunction& operator=(std::nullptr_t) {
+    reset();
+    return *this;
+  }
+
+  R operator()(Args... args) const {
+    return _ops->invoke(&_storage, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const {
+    return _ops != nullptr;
+  }
+
+ private:
+  typedef typename std::aligned_storage<Capacity, alignof(void*)>::type Storage;
+
+  struct Ops {
+    R (*invoke)(const void* storage, Args&&... args);
+    void (*copy)(void* dst, const void* src);
+    void (*move)(void* dst, void* src);
+    void (*destroy)(void* storage);
+  };
+
+  template <typename Callable>
+  struct Manager {
+    static R invoke(const void* storage, Args&&... args) {
+      return (*const_cast<Callable*>(static_cast<const Callable*>(storage)))(std::forward<Args>(args)...);
+    }
+    static void copy(void* dst, const void* src) {
+      new (dst) Callable(*static_cast<const Callable*>(src));
+    }
+    static void move(void* dst, void* src) {
+      new (dst) Callable(std::move(*static_cast<Callable*>(src)));
+    }
+    static void destroy(void* storage) {
+      static_cast<Callable*>(storage)->~Callable();
+    }
+    static const Ops& ops() {
+      static const Ops ops = {invoke, copy, move, destroy};
+      return ops;
+    }
+  };
+
+  const Ops* _ops;
+  Storage _storage;
+
+  void reset() {
+    if (_ops) {
+      _ops->destroy(&_storage);
+      _ops = nullptr;
+    }
+  }
+};
+
+#endif  // end InplaceFunction_h
@@ -0,0 +1,130 @@
+#ifndef JsonStateStreamer_h
+#define JsonStateStreamer_h
+
+#include <ESPAsyncWebServer.h>
+#include <StatefulService.h>
+
+#include <memory>
+
+/**
+ * Reads the element at index of a collection held in the state, returning false once index is past the end.
+ */
+template <typename T>
+using JsonElementReader = std::function<bool(T& settings, size_t index, JsonObject& root)>;
+
+/**
+ * Streams a state whose size is dominated by one large array as a chunked JSON response.
+ *
+ * The state is written as the object produced by the head reader, followed by the array member, whose elements are
+ * read and serialized one at a time. Only one element (or the head) is held in memory at once, so the largest
+ * allocation is bounded by the buffer size given rather than by the size of the state. Each piece is read under the
+ * service's lock, but the state is not locked for the duration of the response.
+ */
+template <class T>
+class JsonStateStreamer {
+ public:
+  JsonStateStreamer() : _arrayKey(nullptr) {
+  }
+
+  JsonStateStreamer(JsonStateReader<T> headReader, const char* arrayKey, JsonElementReader<T> elementReader) :
+      _headReader(headReader), _arrayKey(arrayKey), _elementReader(elementReader) {
+  }
+
+  explicit operator bool() const {
+    return (bool)_elementReader;
+  }
+
+  /**
+   * Begins a chunked response streaming the service's state, the streamer must outlive the response.
+   */
+  AsyncWebServerResponse* beginResponse(AsyncWebServerRequest* request,
+                                        StatefulService<T>* statefulService,
+                                        size_t bufferSize) const {
+    std::shared_ptr<Stream> stream = std::make_shared<Stream>();
+    return request->beginChunkedResponse(
+        "application/json",
+        [this, statefulService, bufferSize, stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+          size_t written = 0;
+          while (written < maxLen) {
+            if (stream->pendingOffset < stream->pending.length()) {
+              size_t length = stream->pending.length() - stream->pendingOffset;
+              if (length > maxLen - written) {
+                length = maxLen - written;
+              }
+              memcpy(&buffer[written], stream->pending.c_str() + stream->pendingOffset, length);
+              stream->pendingOffset += length;
+              written += length;
+              continue;
+            }
+            if (stream->stage == StreamStage::DONE) {
+              break;
+            }
+            stream->pending = next(*stream, statefulService, bufferSize);
+            stream->pendingOffset = 0;
+          }
+          return written;
+        });
+  }
+
+ private:
+  enum class StreamStage { HEAD, ELEMENTS, DONE };
+
+  struct Stream {
+    StreamStage stage = StreamStage::HEAD;
+    size_t elementIndex = 0;
+    String pending;
+    size_t pendingOffset = 0;
+  };
+
+  JsonStateReader<T> _headReader;
+  const char* _arrayKey;
+  JsonElementReader<T> _elementReader;
+
+  /**
+   * Formats the next piece of the response: the head and the opening of the array, one element, or the closing. A head
+   * or an element which overflows the buffer ends the response with an error member in its place rather than a
+   * truncated piece, so the response stays valid JSON and the client can tell it was cut short.
+   */
+  String next(Stream& stream, StatefulService<T>* statefulService, size_t bufferSize) const {
+    DynamicJsonDocument jsonDocument = DynamicJsonDocument(bufferSize);
+    JsonObject root = jsonDocument.to<JsonObject>();
+    String json;
+    if (stream.stage == StreamStage::HEAD) {
+      statefulService->read(root, _headReader);
+      if (root.isNull() || jsonDocument.overflowed()) {
+        stream.stage = StreamStage::DONE;
+        return "{\"error\":\"state too large\"}";
+      }
+      serializeJson(jsonDocument, json);
+      // reopen the head object to append the array member
+      json.remove(json.length() - 1);
+      if (root.size() > 0) {
+        json += ",";
+      }
+      json += "\"";
+      json += _arrayKey;
+      json += "\":[";
+      stream.stage = StreamStage::ELEMENTS;
+      return json;
+    }
+    bool found = false;
+    statefulService->read([&](T& settings) { found = _elementReader(settings, stream.elementIndex, root); });
+    if (!found) {
+      stream.stage = StreamStage::DONE;
+      return "]}";
+    }
+    if (jsonDocument.overflowed()) {
+      stream.stage = StreamStage::DONE;
+      return "],\"error\":\"element too large\",\"element\":" + String(stream.elementIndex) + "}";
+    }
+    if (stream.elementIndex++ > 0) {
+      json = ",";
+    }
+    String element;
+    serializeJson(jsonDocument, element);
+    json += element;
+    return json;
+  }
+};
+
+#endif  // end JsonStateStreamer_h
@@ -0,0 +1,205 @@
+#include <JsonStreamParser.h>
+
+JsonStreamParser::JsonStreamParser(const char* arrayKey,
+                                   size_t bufferSize,
+                                   ElementsStartCallback elementsStartCallback,
+                                   ElementCallback elementCallback) :
+    _arrayKey(arrayKey),
+    _bufferSize(bufferSize),
+    _elementsStartCallback(elementsStartCallback),
+    _elementCallback(elementCallback),
+    _error(JsonStreamError::NONE),
+    _mode(ParseMode::HEAD),
+    _depth(0),
+    _inString(false),
+    _escaped(false),
+    _expectKey(false),
+    _readingKey(false),
+    _keyComplete(false),
+    _awaitArray(false),
+    _complete(false) {
+}
+
+void JsonStreamParser::parse(const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len && _error == JsonStreamError::NONE; i++) {
+    char c = data[i];
+    // whitespace between tokens is dropped, which also compacts the buffered head and elements
+    if (!_inString && (c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+      continue;
+    }
+    switch (_mode) {
+      case ParseMode::HEAD:
+        parseHead(c);
+        break;
+      case ParseMode::ELEMENTS:
+        parseElements(c);
+        break;
+      case ParseMode::ELEMENT:
+        parseElement(c);
+        break;
+    }
+  }
+}
+
+JsonStreamError JsonStreamParser::finish(JsonDocument& head) {
+  if (_error != JsonStreamError::NONE) {
+    return _error;
+  }
+  if (!_complete) {
+    return _error = JsonStreamError::INVALID;
+  }
+  DeserializationError error = deserializeJson(head, _head);
+  if (error) {
+    return _error = deserializationError(error);
+  }
+  return JsonStreamError::NONE;
+}
+
+void JsonStreamParser::parseHead(char c) {
+  if (_inString) {
+    append(_head, c);
+    if (_escaped) {
+      _escaped = false;
+    } else if (c == '\\') {
+      _escaped = true;
+    } else if (c == '"') {
+      _inString = false;
+      if (_readingKey) {
+        _readingKey = false;
+        _keyComplete = true;
+      }
+      return;
+    }
+    // a key longer than the array key can never match it, so it is not read further
+    if (_readingKey && _key.length() <= strlen(_arrayKey)) {
+      _key += c;
+    }
+    return;
+  }
+  if (_complete || (_depth == 0 && c != '{')) {
+    _error = JsonStreamError::INVALID;
+    return;
+  }
+  if (_awaitArray) {
+    _awaitArray = false;
+    if (c == '[') {
+      // the elements are passed to the callback, the head keeps an empty array in their place
+      append(_head, '[');
+      append(_head, ']');
+      _depth++;
+      _mode = ParseMode::ELEMENTS;
+      if (_elementsStartCallback) {
+        _elementsStartCallback();
+      }
+      return;
+    }
+  }
+  bool keyComplete = _keyComplete;
+  _keyComplete = false;
+  switch (c) {
+    case '"':
+      _inString = true;
+      if (_depth == 1 && _expectKey) {
+        _expectKey = false;
+        _readingKey = true;
+        _key = "";
+      }
+      break;
+    case '{':
+    case '[':
+      _depth++;
+      _expectKey = c == '{' && _depth == 1;
+      break;
+    case '}':
+    case ']':
+      if (--_depth == 0) {
+        _complete = true;
+      }
+      break;
+    case ',':
+      _expectKey = _depth == 1;
+      break;
+    case ':':
+      _awaitArray = keyComplete && _depth == 1 && _key == _arrayKey;
+      break;
+  }
+  append(_head, c);
+}
+
+void JsonStreamParser::parseElements(char c) {
+  if (c == ',') {
+    return;
+  }
+  if (c == ']') {
+    _depth--;
+    _mode = ParseMode::HEAD;
+    return;
+  }
+  if (c != '{') {
+    _error = JsonStreamError::INVALID;
+    return;
+  }
+  _depth++;
+  _mode = ParseMode::ELEMENT;
+  append(_element, c);
+}
+
+void JsonStreamParser::parseElement(char c) {
+  append(_element, c);
+  if (_inString) {
+    if (_escaped) {
+      _escaped = false;
+    } else if (c == '\\') {
+      _escaped = true;
+    } else if (c == '"') {
+      _inString = false;
+    }
+    return;
+  }
+  switch (c) {
+    case '"':
+      _inString = true;
+      break;
+    case '{':
+    case '[':
+      _depth++;
+      break;
+    case '}':
+    case ']':
+      // the array itself is at depth two
+      if (--_depth == 2) {
+        completeElement();
+      }
+      break;
+  }
+}
+
+void JsonStreamParser::completeElement() {
+  _mode = ParseMode::ELEMENTS;
+  if (_error != JsonStreamError::NONE) {
+    return;
+  }
+  DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
+  DeserializationError error = deserializeJson(jsonDocument, _element);
+  _element = "";
+  if (error) {
+    _error = deserializationError(error);
+    return;
+  }
+  JsonObject element = jsonDocument.as<JsonObject>();
+  if (!_elementCallback(element)) {
+    _error = JsonStreamError::REJECTED;
+  }
+}
+
+void JsonStreamParser::append(String& buffer, char c) {
+  if (buffer.length() >= _bufferSize) {
+    _error = JsonStreamError::TOO_LARGE;
+    return;
+  }
+  buffer += c;
+}
+
+JsonStreamError JsonStreamParser::deserializationError(DeserializationError error) {
+  return error == DeserializationError::NoMemory ? JsonStreamError::TOO_LARGE : JsonStreamError::INVALID;
+}
@@ -0,0 +1,103 @@
+#ifndef JsonStreamParser_h
+#define JsonStreamParser_h
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <StatefulService.h>
+
+#include <functional>
+
+enum class JsonStreamError { NONE, INVALID, TOO_LARGE, REJECTED };
+
+/**
+ * Incrementally parses a JSON object whose size is dominated by one array member, as the bytes arrive.
+ *
+ * The elements of the array are deserialized one at a time, each into a document of the buffer size, and handed to
+ * the element callback before the next one is read. The remaining members (the head) are collected and deserialized
+ * once the object is complete, with the array member replaced by an empty array. Neither the head nor any single
+ * element may exceed the buffer size, the number of elements is unbounded.
+ *
+ * Array elements must be objects and the array key is matched literally, so it should be a plain identifier.
+ */
+class JsonStreamParser {
+ public:
+  typedef std::function<void()> ElementsStartCallback;
+  typedef std::function<bool(JsonObject& element)> ElementCallback;
+
+  JsonStreamParser(const char* arrayKey,
+                   size_t bufferSize,
+                   ElementsStartCallback elementsStartCallback,
+                   ElementCallback elementCallback);
+
+  void parse(const uint8_t* data, size_t len);
+
+  /**
+   * Completes the parse, deserializing the head into the document provided.
+   */
+  JsonStreamError finish(JsonDocument& head);
+
+  JsonStreamError getError() {
+    return _error;
+  }
+
+ private:
+  enum class ParseMode { HEAD, ELEMENTS, ELEMENT };
+
+  const char* _arrayKey;
+  size_t _bufferSize;
+  ElementsStartCallback _elementsStartCallback;
+  ElementCallback _elementCallback;
+  JsonStreamError _error;
+  ParseMode _mode;
+  int _depth;
+  bool _inString;
+  bool _escaped;
+  bool _expectKey;
+  bool _readingKey;
+  bool _keyComplete;
+  bool _awaitArray;
+  bool _complete;
+  String _key;
+  String _head;
+  String _element;
+
+  void parseHead(char c);
+  void parseElements(char c);
+  void parseElement(char c);
+  void completeElement();
+  void append(String& buffer, char c);
+  static JsonStreamError deserializationError(DeserializationError error);
+};
+
+/**
+ * Builds a state from a streamed request body, receiving one array element at a time and applying the result to the
+ * state once the body is complete. A builder is created for each request, so it may accumulate the elements in a
+ * typed form (such as a list of schedules) without touching the live state until the update is applied.
+ */
+template <class T>
+class JsonStateBuilder {
+ public:
+  virtual ~JsonStateBuilder() {
+  }
+
+  /**
+   * Called when the array member is found in the body, before any element is added.
+   */
+  virtual void beginElements() {
+  }
+
+  /**
+   * Adds an element of the array, returning false to reject the update.
+   */
+  virtual bool addElement(JsonObject& element) = 0;
+
+  /**
+   * Applies the built state, the root holds the members of the body other than the array.
+   */
+  virtual StateUpdateResult apply(JsonObject& root, T& settings) = 0;
+};
+
+template <typename T>
+using JsonStateBuilderFactory = std::function<JsonStateBuilder<T>*()>;
+
+#endif  // end JsonStreamParser_h
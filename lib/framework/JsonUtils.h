@@ -24,6 +24,46 @@ class JsonUtils {
       root[key] = ip.toString();
     }
   }
+
+  /**
+   * Applies an RFC 7386 merge patch to the target: null members are removed, objects are merged recursively and any
+   * other value replaces the target's member.
+   */
+  static void mergePatch(JsonObject target, JsonObject patch) {
+    for (JsonPair kv : patch) {
+      const char* key = kv.key().c_str();
+      JsonVariant value = kv.value();
+      if (value.isNull()) {
+        target.remove(key);
+      } else if (value.is<JsonObject>()) {
+        JsonObject member = target[key].as<JsonObject>();
+        if (member.isNull()) {
+          target.remove(key);
+          member = target.createNestedObject(key);
+        }
+        mergePatch(member, value.as<JsonObject>());
+      } else {
+        target[key] = value;
+      }
+    }
+  }
+
+  /**
+   * Copies the members of the source named by the patch into the delta, following the patch's nested objects, so the
+   * outcome of a merge patch can be reported without the members it left alone. Keys are copied into the delta, which
+   * may outlive the patch.
+   */
+  static void projectPatch(JsonObject source, JsonObject patch, JsonObject delta) {
+    for (JsonPair kv : patch) {
+      String key = kv.key().c_str();
+      JsonVariant value = source[key];
+      if (kv.value().is<JsonObject>() && value.is<JsonObject>()) {
+        projectPatch(value.as<JsonObject>(), kv.value().as<JsonObject>(), delta.createNestedObject(key));
+      } else {
+        delta[key] = value;
+      }
+    }
+  }
 };
 
 #endif  // end JsonUtils
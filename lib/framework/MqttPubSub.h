@@ -39,7 +39,9 @@ class MqttPub : virtual public MqttConnector<T> {
       _stateReader(stateReader),
       _pubTopic(pubTopic),
       _retain(retain) {
-    MqttConnector<T>::_statefulService->addUpdateHandler([&](const String& originId) { publish(); }, false);
+    if (!MqttConnector<T>::_statefulService->addUpdateHandler([&](const String& originId) { publish(); }, false)) {
+      Serial.println(F("MqttPubSub will not publish changes"));
+    }
   }
 
   void setRetain(const bool retain) {
@@ -65,9 +67,13 @@ class MqttPub : virtual public MqttConnector<T> {
   void publish() {
     if (_pubTopic.length() > 0 && MqttConnector<T>::_mqttClient->connected()) {
       // serialize to json doc
-      DynamicJsonDocument json(MqttConnector<T>::_bufferSize);
+      DynamicJsonDocument json(MqttConnector<T>::_statefulService->getJsonCapacity(MqttConnector<T>::_bufferSize));
       JsonObject jsonObject = json.to<JsonObject>();
       MqttConnector<T>::_statefulService->read(jsonObject, _stateReader);
+      if (json.overflowed()) {
+        Serial.printf_P(PSTR("State for %s overflowed its JSON buffer and was not published\r\n"), _pubTopic.c_str());
+        return;
+      }
 
       // serialize to string
       String payload;
@@ -13,12 +13,14 @@ MqttStatus::MqttStatus(AsyncWebServer* server,
 void MqttStatus::mqttStatus(AsyncWebServerRequest* request) {
   AsyncJsonResponse* response = new AsyncJsonResponse(false, MAX_MQTT_STATUS_SIZE);
   JsonObject root = response->getRoot();
+  readStatus(root);
+  response->setLength();
+  request->send(response);
+}
 
+void MqttStatus::readStatus(JsonObject& root) {
   root["enabled"] = _mqttSettingsService->isEnabled();
   root["connected"] = _mqttSettingsService->isConnected();
   root["client_id"] = _mqttSettingsService->getClientId();
   root["disconnect_reason"] = (uint8_t)_mqttSettingsService->getDisconnectReason();
-
-  response->setLength();
-  request->send(response);
 }
@@ -22,6 +22,8 @@ class MqttStatus {
  public:
   MqttStatus(AsyncWebServer* server, MqttSettingsService* mqttSettingsService, SecurityManager* securityManager);
 
+  void readStatus(JsonObject& root);
+
  private:
   MqttSettingsService* _mqttSettingsService;
 
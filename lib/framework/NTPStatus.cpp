@@ -29,7 +29,12 @@ String toLocalTimeString(tm* time) {
 void NTPStatus::ntpStatus(AsyncWebServerRequest* request) {
   AsyncJsonResponse* response = new AsyncJsonResponse(false, MAX_NTP_STATUS_SIZE);
   JsonObject root = response->getRoot();
+  readStatus(root);
+  response->setLength();
+  request->send(response);
+}
 
+void NTPStatus::readStatus(JsonObject& root) {
   // grab the current instant in unix seconds
   time_t now = time(nullptr);
 
@@ -47,7 +52,4 @@ void NTPStatus::ntpStatus(AsyncWebServerRequest* request) {
 
   // device uptime in seconds
   root["uptime"] = millis() / 1000;
-
-  response->setLength();
-  request->send(response);
 }
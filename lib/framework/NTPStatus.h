@@ -24,6 +24,8 @@ class NTPStatus {
  public:
   NTPStatus(AsyncWebServer* server, SecurityManager* securityManager);
 
+  void readStatus(JsonObject& root);
+
  private:
   void ntpStatus(AsyncWebServerRequest* request);
 };
@@ -0,0 +1,248 @@
+#ifndef NdjsonEndpoint_h
+#define NdjsonEndpoint_h
+
+#include <functional>
+#include <memory>
+
+#include <ESPAsyncWebServer.h>
+
+#include <JsonStateStreamer.h>
+#include <JsonStreamParser.h>
+#include <SecurityManager.h>
+#include <StatefulService.h>
+
+#define NDJSON_ENDPOINT_ORIGIN_ID "ndjson"
+#define NDJSON_CONTENT_TYPE "application/x-ndjson"
+
+// imports in progress at once, each holds a line buffer and a state builder until its body is complete
+#ifndef NDJSON_ENDPOINT_MAX_IMPORTS
+#define NDJSON_ENDPOINT_MAX_IMPORTS 1
+#endif
+
+/**
+ * Exports and imports the elements of a collection held in the state as newline delimited JSON, one element per line.
+ *
+ * GET streams the elements as a chunked response, reading and serializing one element at a time under the service's
+ * lock. POST parses the body as it arrives, feeding each line to a JsonStateBuilder created for the request, which
+ * replaces the collection once the body is complete. Neither direction holds more than one element, bounded by the
+ * buffer size, in addition to the builder.
+ */
+template <class T>
+class NdjsonEndpoint {
+ public:
+  NdjsonEndpoint(JsonElementReader<T> elementReader,
+                 JsonStateBuilderFactory<T> stateBuilderFactory,
+                 StatefulService<T>* statefulService,
+                 AsyncWebServer* server,
+                 const String& servicePath,
+                 SecurityManager* securityManager,
+                 AuthenticationPredicate authenticationPredicate = AuthenticationPredicates::IS_ADMIN,
+                 size_t bufferSize = DEFAULT_BUFFER_SIZE) :
+      _elementReader(elementReader),
+      _stateBuilderFactory(stateBuilderFactory),
+      _statefulService(statefulService),
+      _authenticationFilter(securityManager->filterRequest(authenticationPredicate)),
+      _bufferSize(bufferSize) {
+    server->on(servicePath.c_str(),
+               HTTP_GET,
+               securityManager->wrapRequest(std::bind(&NdjsonEndpoint::exportElements, this, std::placeholders::_1),
+                                            authenticationPredicate));
+    server->on(servicePath.c_str(),
+               HTTP_POST,
+               securityManager->wrapRequest(std::bind(&NdjsonEndpoint::importElements, this, std::placeholders::_1),
+                                            authenticationPredicate),
+               nullptr,
+               std::bind(&NdjsonEndpoint::handleBody,
+                         this,
+                         std::placeholders::_1,
+                         std::placeholders::_2,
+                         std::placeholders::_3,
+                         std::placeholders::_4,
+                         std::placeholders::_5));
+  }
+
+ private:
+  struct Export {
+    size_t elementIndex = 0;
+    bool done = false;
+    String pending;
+    size_t pendingOffset = 0;
+  };
+
+  struct Import {
+    AsyncWebServerRequest* request = nullptr;
+    std::unique_ptr<JsonStateBuilder<T>> builder;
+    String line;
+    size_t elements = 0;
+    JsonStreamError error = JsonStreamError::NONE;
+  };
+
+  JsonElementReader<T> _elementReader;
+  JsonStateBuilderFactory<T> _stateBuilderFactory;
+  StatefulService<T>* _statefulService;
+  ArRequestFilterFunction _authenticationFilter;
+  size_t _bufferSize;
+  Import _imports[NDJSON_ENDPOINT_MAX_IMPORTS];
+
+  void exportElements(AsyncWebServerRequest* request) {
+    std::shared_ptr<Export> stream = std::make_shared<Export>();
+    request->send(request->beginChunkedResponse(
+        NDJSON_CONTENT_TYPE, [this, stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+          size_t written = 0;
+          while (written < maxLen) {
+            if (stream->pendingOffset < stream->pending.length()) {
+              size_t length = stream->pending.length() - stream->pendingOffset;
+              if (length > maxLen - written) {
+                length = maxLen - written;
+              }
+              memcpy(&buffer[written], stream->pending.c_str() + stream->pendingOffset, length);
+              stream->pendingOffset += length;
+              written += length;
+              continue;
+            }
+            if (stream->done) {
+              break;
+            }
+            stream->pending = nextLine(*stream);
+            stream->pendingOffset = 0;
+          }
+          return written;
+        }));
+  }
+
+  /**
+   * Formats the next element as a line, or returns an empty line and marks the export done past the last element. An
+   * element which overflows the buffer ends the export with an error record in its place rather than a truncated
+   * element, so the client can tell the export was cut short.
+   */
+  String nextLine(Export& stream) {
+    DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
+    JsonObject root = jsonDocument.to<JsonObject>();
+    bool found = false;
+    _statefulService->read([&](T& settings) { found = _elementReader(settings, stream.elementIndex, root); });
+    String line;
+    if (!found) {
+      stream.done = true;
+      return line;
+    }
+    if (jsonDocument.overflowed()) {
+      stream.done = true;
+      return "{\"error\":\"element too large\",\"element\":" + String(stream.elementIndex) + "}\n";
+    }
+    stream.elementIndex++;
+    serializeJson(jsonDocument, line);
+    line += "\n";
+    return line;
+  }
+
+  void handleBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
+    Import* import = index ? find(request) : begin(request);
+    if (!import) {
+      return;
+    }
+    for (size_t i = 0; i < len && import->error == JsonStreamError::NONE; i++) {
+      char c = data[i];
+      if (c == '\n') {
+        addLine(*import);
+      } else if (import->line.length() >= _bufferSize) {
+        import->error = JsonStreamError::TOO_LARGE;
+      } else if (c != '\r') {
+        import->line += c;
+      }
+    }
+  }
+
+  /**
+   * Applies the import once the body is complete, the last line need not end with a newline.
+   */
+  void importElements(AsyncWebServerRequest* request) {
+    Import* import = find(request);
+    // an empty body empties the collection
+    if (!import && !request->contentLength()) {
+      import = begin(request);
+    }
+    if (!import) {
+      request->send(503);
+      return;
+    }
+    addLine(*import);
+    JsonStreamError error = import->error;
+    size_t elements = import->elements;
+    StateUpdateResult outcome = StateUpdateResult::ERROR;
+    if (error == JsonStreamError::NONE) {
+      JsonStateBuilder<T>* builder = import->builder.get();
+      DynamicJsonDocument jsonDocument = DynamicJsonDocument(JSON_OBJECT_SIZE(0));
+      JsonObject root = jsonDocument.to<JsonObject>();
+      outcome = _statefulService->updateWithoutPropagation([&](T& settings) { return builder->apply(root, settings); });
+    }
+    release(request);
+    if (outcome == StateUpdateResult::ERROR) {
+      request->send(error == JsonStreamError::TOO_LARGE ? 413 : 400);
+      return;
+    }
+    if (outcome == StateUpdateResult::CHANGED) {
+      request->onDisconnect([this]() { _statefulService->callUpdateHandlers(NDJSON_ENDPOINT_ORIGIN_ID); });
+    }
+    request->send(200, "application/json", "{\"elements\":" + String(elements) + "}");
+  }
+
+  void addLine(Import& import) {
+    import.line.trim();
+    if (import.error != JsonStreamError::NONE || import.line.length() == 0) {
+      return;
+    }
+    DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
+    DeserializationError error = deserializeJson(jsonDocument, import.line);
+    import.line = "";
+    if (error || !jsonDocument.is<JsonObject>()) {
+      import.error = error == DeserializationError::NoMemory ? JsonStreamError::TOO_LARGE : JsonStreamError::INVALID;
+      return;
+    }
+    JsonObject element = jsonDocument.as<JsonObject>();
+    if (!import.builder->addElement(element)) {
+      import.error = JsonStreamError::REJECTED;
+      return;
+    }
+    import.elements++;
+  }
+
+  Import* begin(AsyncWebServerRequest* request) {
+    if (_authenticationFilter && !_authenticationFilter(request)) {
+      return nullptr;
+    }
+    for (Import& import : _imports) {
+      if (!import.request) {
+        import.request = request;
+        import.builder.reset(_stateBuilderFactory());
+        import.builder->beginElements();
+        import.line = "";
+        import.elements = 0;
+        import.error = JsonStreamError::NONE;
+        // frees the import if the client goes away before the body is complete
+        request->onDisconnect([this, request]() { release(request); });
+        return &import;
+      }
+    }
+    return nullptr;
+  }
+
+  Import* find(AsyncWebServerRequest* request) {
+    for (Import& import : _imports) {
+      if (import.request == request) {
+        return &import;
+      }
+    }
+    return nullptr;
+  }
+
+  void release(AsyncWebServerRequest* request) {
+    Import* import = find(request);
+    if (import) {
+      import->builder.reset();
+      import->line = "";
+      import->request = nullptr;
+    }
+  }
+};
+
+#endif  // end NdjsonEndpoint_h
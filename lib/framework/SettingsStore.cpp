@@ -0,0 +1,343 @@
+#include <SettingsStore.h>
+
+SettingsStore::SettingsStore(FS* fs, const char* path) :
+    _fs(fs),
+    _path(path),
+    _count(0),
+    _size(0),
+    _intact(true),
+    _overflowed(false) {
+}
+
+void SettingsStore::begin() {
+  FSPersistenceBase::lock();
+  closeReader();
+  _count = 0;
+  _size = 0;
+  _intact = true;
+  _overflowed = false;
+  recoverLog();
+  if (_fs->exists(_path)) {
+    File file = _fs->open(_path, "r");
+    _intact = file && scan(file);
+    if (file) {
+      file.close();
+    }
+  }
+  if (_overflowed) {
+    Serial.printf_P(PSTR("Settings store %s holds more than %d keys, not compacting\r\n"),
+                    _path.c_str(),
+                    SETTINGS_STORE_MAX_KEYS);
+  }
+  if (!_intact || needsCompaction()) {
+    compact();
+  }
+  FSPersistenceBase::unlock();
+}
+
+bool SettingsStore::read(const String& key, SettingsValueReader reader, FSPersistenceBase::ContentHash& hash) {
+  hash.known = false;
+  FSPersistenceBase::lock();
+  SettingsEntry* entry = find(key);
+  if (!entry) {
+    FSPersistenceBase::unlock();
+    return false;
+  }
+  if (!_reader) {
+    _reader = _fs->open(_path, "r");
+  }
+  bool loaded = false;
+  if (_reader && _reader.seek(entry->offset + SETTINGS_STORE_HEADER_LENGTH + entry->key.length())) {
+    ValueStream in(_reader, entry->length);
+    loaded = reader(in, entry->length, entry->version);
+    if (loaded) {
+      hash = {true, entry->length, entry->checksum};
+    }
+  }
+  FSPersistenceBase::unlock();
+  return loaded;
+}
+
+bool SettingsStore::write(const String& key,
+                          uint16_t version,
+                          size_t length,
+                          uint32_t checksum,
+                          SettingsValueWriter writer) {
+  if (key.length() == 0 || key.length() > 255) {
+    return false;
+  }
+  FSPersistenceBase::lock();
+  SettingsEntry* entry = find(key);
+  // a record cut short must be compacted away first, anything appended after it would be lost
+  if (FSPersistenceBase::writesSuspended() || (!entry && _count == SETTINGS_STORE_MAX_KEYS) ||
+      (!_intact && !compact())) {
+    FSPersistenceBase::unlock();
+    return false;
+  }
+  uint32_t offset;
+  bool written = append(key, 0, version, length, checksum, writer, offset);
+  if (written) {
+    if (!entry) {
+      entry = &_entries[_count++];
+      entry->key = key;
+    }
+    entry->version = version;
+    entry->offset = offset;
+    entry->length = length;
+    entry->checksum = checksum;
+  }
+  if (!_intact || needsCompaction()) {
+    compact();
+  }
+  FSPersistenceBase::unlock();
+  return written;
+}
+
+bool SettingsStore::remove(const String& key) {
+  FSPersistenceBase::lock();
+  SettingsEntry* entry = find(key);
+  if (!entry) {
+    FSPersistenceBase::unlock();
+    return true;
+  }
+  uint32_t offset;
+  bool removed = !FSPersistenceBase::writesSuspended() && (_intact || compact()) &&
+                 append(key, SETTINGS_STORE_FLAG_REMOVED, 0, 0, 0, nullptr, offset);
+  if (removed) {
+    for (SettingsEntry* last = &_entries[--_count]; entry < last; entry++) {
+      *entry = *(entry + 1);
+    }
+  }
+  if (!_intact || needsCompaction()) {
+    compact();
+  }
+  FSPersistenceBase::unlock();
+  return removed;
+}
+
+void SettingsStore::endBatch() {
+  FSPersistenceBase::lock();
+  closeReader();
+  FSPersistenceBase::unlock();
+}
+
+bool SettingsStore::scan(File& file) {
+  size_t size = file.size();
+  uint32_t offset = 0;
+  uint8_t header[SETTINGS_STORE_HEADER_LENGTH];
+  char key[256];
+  while (offset < size) {
+    if (file.read(header, sizeof(header)) != sizeof(header) || memcmp(header, SETTINGS_STORE_RECORD_MAGIC, 2) != 0) {
+      break;
+    }
+    uint8_t flags = header[2];
+    uint8_t keyLength = header[3];
+    uint16_t version = header[4] | (header[5] << 8);
+    uint16_t check = header[6] | (header[7] << 8);
+    uint32_t length = (uint32_t)header[8] | ((uint32_t)header[9] << 8) | ((uint32_t)header[10] << 16) |
+                      ((uint32_t)header[11] << 24);
+    uint32_t expected = (uint32_t)header[12] | ((uint32_t)header[13] << 8) | ((uint32_t)header[14] << 16) |
+                        ((uint32_t)header[15] << 24);
+    if (!keyLength || offset + sizeof(header) + keyLength + length > size ||
+        file.read((uint8_t*)key, keyLength) != keyLength) {
+      break;
+    }
+    key[keyLength] = '\0';
+    String recordKey = key;
+    uint32_t checksum;
+    if (headerCheck(header, recordKey) != check || !FSPersistenceBase::checksumFile(file, length, checksum) ||
+        checksum != expected) {
+      break;
+    }
+
+    // later records supersede earlier ones
+    SettingsEntry* entry = find(recordKey);
+    if (flags & SETTINGS_STORE_FLAG_REMOVED) {
+      if (entry) {
+        for (SettingsEntry* last = &_entries[--_count]; entry < last; entry++) {
+          *entry = *(entry + 1);
+        }
+      }
+    } else if (entry || _count < SETTINGS_STORE_MAX_KEYS) {
+      if (!entry) {
+        entry = &_entries[_count++];
+        entry->key = recordKey;
+      }
+      entry->version = version;
+      entry->offset = offset;
+      entry->length = length;
+      entry->checksum = checksum;
+    } else {
+      _overflowed = true;
+    }
+    offset += sizeof(header) + keyLength + length;
+  }
+  _size = offset;
+  return offset == size;
+}
+
+bool SettingsStore::append(const String& key,
+                           uint8_t flags,
+                           uint16_t version,
+                           size_t length,
+                           uint32_t checksum,
+                           SettingsValueWriter writer,
+                           uint32_t& offset) {
+  closeReader();
+  if (!_size) {
+    FSPersistenceBase::mkdirs(_fs, _path);
+  }
+  File file = _fs->open(_path, "a");
+  if (!file) {
+    return false;
+  }
+  uint8_t header[SETTINGS_STORE_HEADER_LENGTH];
+  encodeHeader(header, key, flags, version, length, checksum);
+  FSPersistenceBase::ChecksumPrint record(&file);
+  record.write(header, sizeof(header));
+  record.write((const uint8_t*)key.c_str(), key.length());
+  FSPersistenceBase::ChecksumPrint value(&record);
+  if (writer) {
+    writer(value);
+  }
+  file.flush();
+  file.close();
+  offset = _size;
+  _size += record.length();
+  bool complete = !record.failed() && value.length() == length && value.checksum() == checksum;
+  if (!complete) {
+    _intact = false;
+  }
+  return complete;
+}
+
+/**
+ * Rewrites the log with the current record of each key, through a temporary file so a reset part way through leaves
+ * either log complete.
+ */
+bool SettingsStore::compact() {
+  // the keys left out of the index would be lost
+  if (_overflowed) {
+    return false;
+  }
+  closeReader();
+  File source = _fs->open(_path, "r");
+  uint32_t offsets[SETTINGS_STORE_MAX_KEYS];
+  uint32_t size = 0;
+  bool replaced = FSPersistenceBase::replaceFile(_fs, _path, [&](Print& out) {
+    for (uint8_t i = 0; i < _count; i++) {
+      SettingsEntry& entry = _entries[i];
+      if (!source || !source.seek(entry.offset + SETTINGS_STORE_HEADER_LENGTH + entry.key.length())) {
+        return false;
+      }
+      uint8_t header[SETTINGS_STORE_HEADER_LENGTH];
+      encodeHeader(header, entry.key, 0, entry.version, entry.length, entry.checksum);
+      FSPersistenceBase::ChecksumPrint record(&out);
+      record.write(header, sizeof(header));
+      record.write((const uint8_t*)entry.key.c_str(), entry.key.length());
+      FSPersistenceBase::ChecksumPrint value(&record);
+      uint8_t block[64];
+      for (uint32_t remaining = entry.length; remaining;) {
+        size_t read = source.read(block, remaining < sizeof(block) ? remaining : sizeof(block));
+        if (!read) {
+          return false;
+        }
+        value.write(block, read);
+        remaining -= read;
+      }
+      if (record.failed() || value.checksum() != entry.checksum) {
+        return false;
+      }
+      offsets[i] = size;
+      size += record.length();
+    }
+    return true;
+  });
+  if (source) {
+    source.close();
+  }
+  if (!replaced) {
+    return false;
+  }
+  for (uint8_t i = 0; i < _count; i++) {
+    _entries[i].offset = offsets[i];
+  }
+  _size = size;
+  _intact = true;
+  // the log is self checking, so the previous log need not be kept
+  _fs->remove(_path + FS_PERSISTENCE_BACKUP_SUFFIX);
+  return true;
+}
+
+bool SettingsStore::needsCompaction() {
+  uint32_t live = 0;
+  for (uint8_t i = 0; i < _count; i++) {
+    live += SETTINGS_STORE_HEADER_LENGTH + _entries[i].key.length() + _entries[i].length;
+  }
+  return _size > SETTINGS_STORE_COMPACT_THRESHOLD && _size - live >= live;
+}
+
+/**
+ * A compaction interrupted between moving the old log aside and moving the new one into place leaves the new log
+ * complete in the temporary file, failing that the old log is the backup. Leftovers are removed otherwise.
+ */
+void SettingsStore::recoverLog() {
+  String tempPath = _path + FS_PERSISTENCE_TEMP_SUFFIX;
+  String backupPath = _path + FS_PERSISTENCE_BACKUP_SUFFIX;
+  if (!_fs->exists(_path)) {
+    if (_fs->exists(tempPath)) {
+      _fs->rename(tempPath, _path);
+    } else if (_fs->exists(backupPath)) {
+      _fs->rename(backupPath, _path);
+    }
+  }
+  if (_fs->exists(tempPath)) {
+    _fs->remove(tempPath);
+  }
+  if (_fs->exists(backupPath)) {
+    _fs->remove(backupPath);
+  }
+}
+
+void SettingsStore::closeReader() {
+  if (_reader) {
+    _reader.close();
+  }
+}
+
+SettingsStore::SettingsEntry* SettingsStore::find(const String& key) {
+  for (uint8_t i = 0; i < _count; i++) {
+    if (_entries[i].key == key) {
+      return &_entries[i];
+    }
+  }
+  return nullptr;
+}
+
+void SettingsStore::encodeHeader(uint8_t* header,
+                                 const String& key,
+                                 uint8_t flags,
+                                 uint16_t version,
+                                 uint32_t length,
+                                 uint32_t checksum) {
+  memcpy(header, SETTINGS_STORE_RECORD_MAGIC, 2);
+  header[2] = flags;
+  header[3] = key.length();
+  for (size_t i = 0; i < 2; i++) {
+    header[4 + i] = version >> (8 * i);
+  }
+  for (size_t i = 0; i < 4; i++) {
+    header[8 + i] = length >> (8 * i);
+    header[12 + i] = checksum >> (8 * i);
+  }
+  uint16_t check = headerCheck(header, key);
+  header[6] = check;
+  header[7] = check >> 8;
+}
+
+uint16_t SettingsStore::headerCheck(const uint8_t* header, const String& key) {
+  // covers everything but the check itself
+  uint32_t crc = FSPersistenceBase::crc32(0, header, 6);
+  crc = FSPersistenceBase::crc32(crc, header + 8, SETTINGS_STORE_HEADER_LENGTH - 8);
+  return FSPersistenceBase::crc32(crc, (const uint8_t*)key.c_str(), key.length());
+}
@@ -0,0 +1,161 @@
+#ifndef SettingsStore_h
+#define SettingsStore_h
+
+#include <FSPersistenceBase.h>
+
+// the framework keeps every service's settings in the store rather than in a file per service
+#ifndef SETTINGS_STORE_ENABLED
+#define SETTINGS_STORE_ENABLED 1
+#endif
+
+#define SETTINGS_STORE_FILE "/config/settings.log"
+
+#ifndef SETTINGS_STORE_MAX_KEYS
+#define SETTINGS_STORE_MAX_KEYS 16
+#endif
+
+// the log is compacted once it has grown past this size (bytes) and at least half of it is stale
+#ifndef SETTINGS_STORE_COMPACT_THRESHOLD
+#define SETTINGS_STORE_COMPACT_THRESHOLD 16384
+#endif
+
+// records start with the magic, the flags, the key length, the value's version (2 bytes), a check of the header and
+// key (2 bytes), then the length and CRC-32 of the value (4 bytes each), all little endian, followed by the key and the
+// value
+#define SETTINGS_STORE_RECORD_MAGIC "SR"
+#define SETTINGS_STORE_HEADER_LENGTH 16
+#define SETTINGS_STORE_FLAG_REMOVED 0x01
+
+/**
+ * Reads a value of the given length and version, returns false if the value could not be used.
+ */
+typedef std::function<bool(Stream& in, size_t length, uint16_t version)> SettingsValueReader;
+
+typedef std::function<void(Print& out)> SettingsValueWriter;
+
+/**
+ * Keeps the settings of many services in a single append-only log rather than a file each. A changed value is
+ * appended as a new record, superseding the earlier ones, so writes move along the log instead of rewriting the same
+ * blocks. The log is rewritten with only the current records once it is mostly stale, or if it ends in a record cut
+ * short by a reset.
+ *
+ * begin() scans and verifies the whole log in one pass, indexing the current record of each key. The log stays open
+ * for reading afterwards, so the values loaded at boot share a single open, until the next write or endBatch(). A log
+ * holding more than SETTINGS_STORE_MAX_KEYS keys, such as one written by firmware with a larger limit, is never
+ * compacted, as that would drop the keys left out of the index.
+ */
+class SettingsStore {
+ public:
+  SettingsStore(FS* fs, const char* path = SETTINGS_STORE_FILE);
+
+  void begin();
+
+  FS* getFS() {
+    return _fs;
+  }
+
+  /**
+   * Passes the key's value to the reader, returning false if the key is not in the store or the reader rejected the
+   * value. The reader is called holding the file system lock. The hash is that of the value.
+   */
+  bool read(const String& key, SettingsValueReader reader, FSPersistenceBase::ContentHash& hash);
+
+  /**
+   * Appends the value produced by the writer, which must match the length and checksum given.
+   */
+  bool write(const String& key, uint16_t version, size_t length, uint32_t checksum, SettingsValueWriter writer);
+
+  bool remove(const String& key);
+
+  /**
+   * Closes the log once the batch of reads made at boot is done.
+   */
+  void endBatch();
+
+ private:
+  struct SettingsEntry {
+    String key;
+    uint16_t version;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t checksum;
+  };
+
+  /**
+   * Bounds reads from the log to a single value.
+   */
+  class ValueStream : public Stream {
+   public:
+    ValueStream(File& file, size_t length) : _file(file), _remaining(length) {
+    }
+
+    int available() {
+      return _remaining;
+    }
+
+    int read() {
+      if (!_remaining) {
+        return -1;
+      }
+      int c = _file.read();
+      if (c >= 0) {
+        _remaining--;
+      }
+      return c;
+    }
+
+    int peek() {
+      return _remaining ? _file.peek() : -1;
+    }
+
+    size_t readBytes(char* buffer, size_t length) {
+      size_t read = _file.read((uint8_t*)buffer, length < _remaining ? length : _remaining);
+      _remaining -= read;
+      return read;
+    }
+
+    size_t write(uint8_t c) {
+      return 0;
+    }
+
+    void flush() {
+    }
+
+   private:
+    File& _file;
+    size_t _remaining;
+  };
+
+  FS* _fs;
+  String _path;
+  SettingsEntry _entries[SETTINGS_STORE_MAX_KEYS];
+  uint8_t _count;
+  uint32_t _size;
+  bool _intact;
+  bool _overflowed;
+  File _reader;
+
+  bool scan(File& file);
+  bool append(const String& key,
+              uint8_t flags,
+              uint16_t version,
+              size_t length,
+              uint32_t checksum,
+              SettingsValueWriter writer,
+              uint32_t& offset);
+  bool compact();
+  bool needsCompaction();
+  void recoverLog();
+  void closeReader();
+  SettingsEntry* find(const String& key);
+
+  static void encodeHeader(uint8_t* header,
+                           const String& key,
+                           uint8_t flags,
+                           uint16_t version,
+                           uint32_t length,
+                           uint32_t checksum);
+  static uint16_t headerCheck(const uint8_t* header, const String& key);
+};
+
+#endif  // end SettingsStore_h
@@ -0,0 +1,244 @@
+#include <StateHistory.h>
+
+#include <memory>
+
+// length (1), uptime (4), changed mask (4), origin length (1), snapshot length (1)
+#define STATE_HISTORY_RECORD_HEADER_SIZE 11
+
+#define STATE_HISTORY_MAX_RECORD_SIZE \
+  (STATE_HISTORY_RECORD_HEADER_SIZE + STATE_HISTORY_ORIGIN_SIZE + STATE_HISTORY_SNAPSHOT_SIZE)
+
+#define STATE_HISTORY_MAX_JSON_SIZE 512
+
+StateHistoryBuffer::StateHistoryBuffer(size_t capacity) :
+#ifdef ESP32
+    _accessMutex(xSemaphoreCreateRecursiveMutex()),
+#endif
+    _buffer(new uint8_t[capacity > STATE_HISTORY_MAX_RECORD_SIZE ? capacity : STATE_HISTORY_MAX_RECORD_SIZE]),
+    _capacity(capacity > STATE_HISTORY_MAX_RECORD_SIZE ? capacity : STATE_HISTORY_MAX_RECORD_SIZE),
+    _head(0),
+    _used(0),
+    _firstSequence(0),
+    _count(0),
+    _snapshotLength(0),
+    _base{},
+    _latest{} {
+}
+
+StateHistoryBuffer::~StateHistoryBuffer() {
+  delete[] _buffer;
+}
+
+void StateHistoryBuffer::record(const uint8_t* snapshot, size_t length, const String& originId, uint32_t uptime) {
+  if (length > STATE_HISTORY_SNAPSHOT_SIZE) {
+    length = STATE_HISTORY_SNAPSHOT_SIZE;
+  }
+  uint8_t originLength = originId.length() > STATE_HISTORY_ORIGIN_SIZE ? STATE_HISTORY_ORIGIN_SIZE : originId.length();
+
+  lock();
+
+  // build the delta against the latest snapshot
+  uint8_t entry[STATE_HISTORY_MAX_RECORD_SIZE];
+  size_t entryLength = STATE_HISTORY_RECORD_HEADER_SIZE;
+  memcpy(&entry[entryLength], originId.c_str(), originLength);
+  entryLength += originLength;
+  uint32_t changedMask = 0;
+  size_t compareLength = length > _snapshotLength ? length : _snapshotLength;
+  for (size_t i = 0; i < compareLength; i++) {
+    uint8_t value = i < length ? snapshot[i] : 0;
+    if (value != _latest[i]) {
+      changedMask |= (uint32_t)1 << i;
+      entry[entryLength++] = value;
+      _latest[i] = value;
+    }
+  }
+  _snapshotLength = length;
+  entry[0] = entryLength;
+  memcpy(&entry[1], &uptime, sizeof(uptime));
+  memcpy(&entry[5], &changedMask, sizeof(changedMask));
+  entry[9] = originLength;
+  entry[10] = length;
+
+  // make room, folding the oldest records into the base snapshot
+  while (_capacity - _used < entryLength) {
+    evictOldest();
+  }
+  write((_head + _used) % _capacity, entry, entryLength);
+  _used += entryLength;
+  _count++;
+
+  unlock();
+}
+
+void StateHistoryBuffer::setBaseline(const uint8_t* snapshot, size_t length) {
+  if (length > STATE_HISTORY_SNAPSHOT_SIZE) {
+    length = STATE_HISTORY_SNAPSHOT_SIZE;
+  }
+  lock();
+  memset(_latest, 0, STATE_HISTORY_SNAPSHOT_SIZE);
+  memcpy(_latest, snapshot, length);
+  _snapshotLength = length;
+  if (_count == 0) {
+    memcpy(_base, _latest, STATE_HISTORY_SNAPSHOT_SIZE);
+  }
+  unlock();
+}
+
+bool StateHistoryBuffer::next(StateHistoryCursor& cursor, StateHistoryRecord& record) {
+  lock();
+  if (cursor.sequence < _firstSequence || cursor.sequence - _firstSequence > _count) {
+    cursor.sequence = _firstSequence;
+    cursor.position = _head;
+    memcpy(cursor.snapshot, _base, STATE_HISTORY_SNAPSHOT_SIZE);
+  }
+  if (cursor.sequence - _firstSequence >= _count) {
+    unlock();
+    return false;
+  }
+  size_t recordLength = readRecord(cursor.position, record, cursor.snapshot);
+  record.sequence = cursor.sequence;
+  memcpy(record.snapshot, cursor.snapshot, STATE_HISTORY_SNAPSHOT_SIZE);
+  cursor.position = (cursor.position + recordLength) % _capacity;
+  cursor.sequence++;
+  unlock();
+  return true;
+}
+
+uint32_t StateHistoryBuffer::nextSequence() {
+  lock();
+  uint32_t sequence = _firstSequence + _count;
+  unlock();
+  return sequence;
+}
+
+void StateHistoryBuffer::evictOldest() {
+  StateHistoryRecord record;
+  size_t recordLength = readRecord(_head, record, _base);
+  _head = (_head + recordLength) % _capacity;
+  _used -= recordLength;
+  _firstSequence++;
+  _count--;
+}
+
+size_t StateHistoryBuffer::readRecord(size_t position, StateHistoryRecord& record, uint8_t* snapshot) {
+  uint8_t header[STATE_HISTORY_RECORD_HEADER_SIZE];
+  read(position, header, STATE_HISTORY_RECORD_HEADER_SIZE);
+  size_t recordLength = header[0];
+  memcpy(&record.uptime, &header[1], sizeof(record.uptime));
+  memcpy(&record.changedMask, &header[5], sizeof(record.changedMask));
+  uint8_t originLength = header[9];
+  record.snapshotLength = header[10];
+
+  uint8_t body[STATE_HISTORY_MAX_RECORD_SIZE];
+  read((position + STATE_HISTORY_RECORD_HEADER_SIZE) % _capacity, body, recordLength - STATE_HISTORY_RECORD_HEADER_SIZE);
+  memcpy(record.originId, body, originLength);
+  record.originId[originLength] = '\0';
+
+  // apply the delta to the snapshot supplied
+  size_t changedIndex = originLength;
+  for (size_t i = 0; i < STATE_HISTORY_SNAPSHOT_SIZE; i++) {
+    if (record.changedMask & ((uint32_t)1 << i)) {
+      snapshot[i] = body[changedIndex++];
+    }
+  }
+  return recordLength;
+}
+
+void StateHistoryBuffer::write(size_t position, const void* data, size_t length) {
+  size_t firstPart = _capacity - position < length ? _capacity - position : length;
+  memcpy(&_buffer[position], data, firstPart);
+  memcpy(_buffer, (const uint8_t*)data + firstPart, length - firstPart);
+}
+
+void StateHistoryBuffer::read(size_t position, void* data, size_t length) {
+  size_t firstPart = _capacity - position < length ? _capacity - position : length;
+  memcpy(data, &_buffer[position], firstPart);
+  memcpy((uint8_t*)data + firstPart, _buffer, length - firstPart);
+}
+
+StateHistoryEndpoint::StateHistoryEndpoint(StateHistoryBuffer* history,
+                                           BinarySnapshotReader snapshotReader,
+                                           AsyncWebServer* server,
+                                           const String& servicePath,
+                                           SecurityManager* securityManager,
+                                           AuthenticationPredicate authenticationPredicate) :
+    _history(history), _snapshotReader(snapshotReader) {
+  server->on(servicePath.c_str(),
+             HTTP_GET,
+             securityManager->wrapRequest(std::bind(&StateHistoryEndpoint::streamHistory, this, std::placeholders::_1),
+                                          authenticationPredicate));
+}
+
+/**
+ * Formats the history one record at a time into a pending chunk of text which is copied out as the TCP window allows.
+ */
+struct StateHistoryStream {
+  StateHistoryCursor cursor;
+  uint32_t endSequence;
+  bool opened = false;
+  bool closed = false;
+  String pending;
+  size_t pendingOffset = 0;
+};
+
+static String formatHistoryRecord(StateHistoryRecord& record, BinarySnapshotReader& snapshotReader) {
+  DynamicJsonDocument jsonDocument(STATE_HISTORY_MAX_JSON_SIZE);
+  JsonObject root = jsonDocument.to<JsonObject>();
+  root["sequence"] = record.sequence;
+  root["uptime"] = record.uptime;
+  root["origin_id"] = (const char*)record.originId;
+  root["changed"] = record.changedMask;
+  if (snapshotReader) {
+    JsonObject state = root.createNestedObject("state");
+    snapshotReader(record.snapshot, record.snapshotLength, state);
+  } else {
+    char hex[STATE_HISTORY_SNAPSHOT_SIZE * 2 + 1];
+    for (size_t i = 0; i < record.snapshotLength; i++) {
+      sprintf(&hex[i * 2], "%02x", record.snapshot[i]);
+    }
+    hex[record.snapshotLength * 2] = '\0';
+    root["snapshot"] = (const char*)hex;
+  }
+  String json;
+  serializeJson(jsonDocument, json);
+  return json;
+}
+
+void StateHistoryEndpoint::streamHistory(AsyncWebServerRequest* request) {
+  std::shared_ptr<StateHistoryStream> stream = std::make_shared<StateHistoryStream>();
+  stream->endSequence = _history->nextSequence();
+  AsyncWebServerResponse* response = request->beginChunkedResponse(
+      "application/json", [this, stream](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+        size_t written = 0;
+        while (written < maxLen) {
+          if (stream->pendingOffset < stream->pending.length()) {
+            size_t length = stream->pending.length() - stream->pendingOffset;
+            if (length > maxLen - written) {
+              length = maxLen - written;
+            }
+            memcpy(&buffer[written], stream->pending.c_str() + stream->pendingOffset, length);
+            stream->pendingOffset += length;
+            written += length;
+            continue;
+          }
+          if (stream->closed) {
+            break;
+          }
+          stream->pending = stream->opened ? "" : "[";
+          stream->pendingOffset = 0;
+          StateHistoryRecord record;
+          if (_history->next(stream->cursor, record) && record.sequence < stream->endSequence) {
+            if (stream->opened) {
+              stream->pending += ",";
+            }
+            stream->pending += formatHistoryRecord(record, _snapshotReader);
+          } else {
+            stream->pending += "]";
+            stream->closed = true;
+          }
+          stream->opened = true;
+        }
+        return written;
+      });
+  request->send(response);
+}
@@ -0,0 +1,171 @@
+#ifndef StateHistory_h
+#define StateHistory_h
+
+#include <StatefulService.h>
+#include <SecurityManager.h>
+#include <ESPAsyncWebServer.h>
+
+#define STATE_HISTORY_SNAPSHOT_SIZE 32
+#define STATE_HISTORY_ORIGIN_SIZE 24
+
+#ifndef STATE_HISTORY_DEFAULT_CAPACITY
+#define STATE_HISTORY_DEFAULT_CAPACITY 1024
+#endif
+
+/**
+ * Encodes the parts of the state worth tracking into a compact, fixed layout binary snapshot of at most
+ * STATE_HISTORY_SNAPSHOT_SIZE bytes, returning the number of bytes used.
+ */
+template <typename T>
+using BinaryStateEncoder = std::function<size_t(T& state, uint8_t* snapshot)>;
+
+/**
+ * Describes a binary snapshot as JSON for diagnostics.
+ */
+typedef std::function<void(const uint8_t* snapshot, size_t length, JsonObject& root)> BinarySnapshotReader;
+
+struct StateHistoryRecord {
+  uint32_t sequence;
+  uint32_t uptime;
+  uint32_t changedMask;
+  char originId[STATE_HISTORY_ORIGIN_SIZE + 1];
+  uint8_t snapshot[STATE_HISTORY_SNAPSHOT_SIZE];
+  size_t snapshotLength;
+};
+
+/**
+ * Iteration state for reading a StateHistoryBuffer, carries the snapshot reconstructed so far. A new cursor starts at
+ * the oldest retained record.
+ */
+struct StateHistoryCursor {
+  uint32_t sequence;
+  size_t position;
+  uint8_t snapshot[STATE_HISTORY_SNAPSHOT_SIZE];
+
+  StateHistoryCursor() : sequence(UINT32_MAX), position(0), snapshot{} {
+  }
+};
+
+/**
+ * A bounded, pre-allocated ring of state changes.
+ *
+ * Each record stores the uptime, the origin of the change, the length of its snapshot and a delta against the previous
+ * snapshot: a bitmask of the snapshot bytes which changed followed by their new values. Records are variable length and packed into a
+ * single byte buffer allocated on construction. When the buffer is full the oldest records are folded into a base
+ * snapshot, so every retained record can still be reconstructed in full.
+ */
+class StateHistoryBuffer {
+ public:
+  StateHistoryBuffer(size_t capacity);
+  ~StateHistoryBuffer();
+
+  void record(const uint8_t* snapshot, size_t length, const String& originId, uint32_t uptime);
+
+  /**
+   * Replaces the baseline the next record is compared against, without adding a record.
+   */
+  void setBaseline(const uint8_t* snapshot, size_t length);
+
+  /**
+   * Reads the record at the cursor and advances it. Cursors pointing at records which have since been evicted are
+   * moved to the oldest retained record. Returns false once the cursor has passed the latest record.
+   */
+  bool next(StateHistoryCursor& cursor, StateHistoryRecord& record);
+
+  uint32_t nextSequence();
+
+ private:
+#ifdef ESP32
+  SemaphoreHandle_t _accessMutex;
+#endif
+  uint8_t* _buffer;
+  size_t _capacity;
+  size_t _head;
+  size_t _used;
+  uint32_t _firstSequence;
+  uint32_t _count;
+  size_t _snapshotLength;
+  uint8_t _base[STATE_HISTORY_SNAPSHOT_SIZE];
+  uint8_t _latest[STATE_HISTORY_SNAPSHOT_SIZE];
+
+  void evictOldest();
+  size_t readRecord(size_t position, StateHistoryRecord& record, uint8_t* snapshot);
+  void write(size_t position, const void* data, size_t length);
+  void read(size_t position, void* data, size_t length);
+
+  inline void lock() {
+#ifdef ESP32
+    xSemaphoreTakeRecursive(_accessMutex, portMAX_DELAY);
+#endif
+  }
+
+  inline void unlock() {
+#ifdef ESP32
+    xSemaphoreGiveRecursive(_accessMutex);
+#endif
+  }
+};
+
+/**
+ * Records every propagated update of a StatefulService into a StateHistoryBuffer.
+ */
+template <class T>
+class StateHistory : public StateHistoryBuffer {
+ public:
+  StateHistory(BinaryStateEncoder<T> stateEncoder,
+               StatefulService<T>* statefulService,
+               size_t capacity = STATE_HISTORY_DEFAULT_CAPACITY) :
+      StateHistoryBuffer(capacity), _stateEncoder(stateEncoder), _statefulService(statefulService) {
+    if (!_statefulService->addUpdateHandler([&](const String& originId) { recordState(originId); }, false)) {
+      Serial.println(F("StateHistory will not record changes"));
+    }
+  }
+
+  /**
+   * Takes the current state as the baseline, call once the state has been loaded so the first record only contains
+   * the first real change.
+   */
+  void captureBaseline() {
+    uint8_t snapshot[STATE_HISTORY_SNAPSHOT_SIZE] = {};
+    size_t length = encode(snapshot);
+    setBaseline(snapshot, length);
+  }
+
+ private:
+  BinaryStateEncoder<T> _stateEncoder;
+  StatefulService<T>* _statefulService;
+
+  size_t encode(uint8_t* snapshot) {
+    size_t length = 0;
+    _statefulService->read([&](T& state) { length = _stateEncoder(state, snapshot); });
+    return length;
+  }
+
+  void recordState(const String& originId) {
+    uint8_t snapshot[STATE_HISTORY_SNAPSHOT_SIZE] = {};
+    size_t length = encode(snapshot);
+    record(snapshot, length, originId, millis());
+  }
+};
+
+/**
+ * Streams the contents of a StateHistoryBuffer as a JSON array using a chunked response, oldest record first. Only
+ * one record is formatted at a time so the response size is not limited by the available heap.
+ */
+class StateHistoryEndpoint {
+ public:
+  StateHistoryEndpoint(StateHistoryBuffer* history,
+                       BinarySnapshotReader snapshotReader,
+                       AsyncWebServer* server,
+                       const String& servicePath,
+                       SecurityManager* securityManager,
+                       AuthenticationPredicate authenticationPredicate = AuthenticationPredicates::IS_ADMIN);
+
+ private:
+  StateHistoryBuffer* _history;
+  BinarySnapshotReader _snapshotReader;
+
+  void streamHistory(AsyncWebServerRequest* request);
+};
+
+#endif  // end StateHistory_h
@@ -0,0 +1,247 @@
+#ifndef StateTransaction_h
+#define StateTransaction_h
+
+#include <StatefulService.h>
+
+#include <functional>
+#include <memory>
+
+#ifndef MAX_TRANSACTION_SERVICES
+#define MAX_TRANSACTION_SERVICES 8
+#endif
+
+/**
+ * Type erased view of the changes staged against a single StatefulService.
+ */
+class StagedStateUpdate {
+ public:
+  virtual ~StagedStateUpdate() {
+  }
+
+  virtual const void* service() const = 0;
+  virtual void lock() = 0;
+  virtual void unlock() = 0;
+
+  /**
+   * Returns true if the service has not changed since its state was copied, called holding the lock.
+   */
+  virtual bool isCurrent() = 0;
+
+  virtual void apply() = 0;
+  virtual void propagate(const String& originId) = 0;
+
+  StateUpdateResult result() const {
+    return _result;
+  }
+
+ protected:
+  StateUpdateResult _result = StateUpdateResult::UNCHANGED;
+
+  void merge(StateUpdateResult result) {
+    if (result == StateUpdateResult::ERROR || _result == StateUpdateResult::ERROR) {
+      _result = StateUpdateResult::ERROR;
+    } else if (result == StateUpdateResult::CHANGED) {
+      _result = StateUpdateResult::CHANGED;
+    }
+  }
+};
+
+template <class T>
+class TypedStagedStateUpdate : public StagedStateUpdate {
+ public:
+  TypedStagedStateUpdate(StatefulService<T>* statefulService) : _statefulService(statefulService) {
+    _statefulService->read([&](T& state) {
+      _staged.reset(new T(state));
+      _version = _statefulService->getVersion();
+    });
+  }
+
+  const void* service() const {
+    return _statefulService;
+  }
+
+  StateUpdateResult stage(JsonObject& jsonObject, JsonStateUpdater<T> stateUpdater) {
+    StateUpdateResult result = stateUpdater(jsonObject, *_staged);
+    merge(result);
+    return result;
+  }
+
+  StateUpdateResult stage(std::function<StateUpdateResult(T&)> stateUpdater) {
+    StateUpdateResult result = stateUpdater(*_staged);
+    merge(result);
+    return result;
+  }
+
+  void lock() {
+    _statefulService->beginTransaction();
+  }
+
+  void unlock() {
+    _statefulService->endTransaction();
+  }
+
+  bool isCurrent() {
+    return _statefulService->getVersion() == _version;
+  }
+
+  void apply() {
+    if (_result == StateUpdateResult::CHANGED) {
+      _statefulService->_state = std::move(*_staged);
+      _statefulService->_version++;
+    }
+  }
+
+  void propagate(const String& originId) {
+    if (_result == StateUpdateResult::CHANGED) {
+      _statefulService->callUpdateHandlers(originId);
+    }
+  }
+
+ private:
+  StatefulService<T>* _statefulService;
+  std::unique_ptr<T> _staged;
+  uint32_t _version;
+};
+
+/**
+ * Batches updates to several StatefulService instances so they are committed together.
+ *
+ * Each service's state is copied the first time it is touched and every update is applied to that copy. On commit the
+ * copies replace the live states while every participating service is locked, so observers never see a partially
+ * applied transaction. If any update reports an error, or any service has changed since its state was copied, nothing
+ * is applied, so a concurrent update is never silently overwritten. Update handlers, and with them persistence
+ * and any reconfiguration side effects, run once per changed service after all states have been replaced.
+ *
+ * Transactions are single use, they are cleared by commit() and abort().
+ */
+class StateTransaction {
+  // prevents the updater from taking part in template argument deduction, allowing lambdas and static functions
+  template <typename U>
+  struct StagedUpdater {
+    typedef U type;
+  };
+
+ public:
+  StateTransaction() : _stagedCount(0), _failed(false) {
+  }
+
+  template <class T>
+  StateUpdateResult update(StatefulService<T>* statefulService,
+                           JsonObject& jsonObject,
+                           typename StagedUpdater<JsonStateUpdater<T>>::type stateUpdater) {
+    TypedStagedStateUpdate<T>* staged = stagedFor(statefulService);
+    if (!staged) {
+      _failed = true;
+      return StateUpdateResult::ERROR;
+    }
+    return track(staged->stage(jsonObject, stateUpdater));
+  }
+
+  template <class T>
+  StateUpdateResult update(StatefulService<T>* statefulService,
+                           typename StagedUpdater<std::function<StateUpdateResult(T&)>>::type stateUpdater) {
+    TypedStagedStateUpdate<T>* staged = stagedFor(statefulService);
+    if (!staged) {
+      _failed = true;
+      return StateUpdateResult::ERROR;
+    }
+    return track(staged->stage(stateUpdater));
+  }
+
+  /**
+   * Applies the staged states and calls each changed service's update handlers once with the given origin.
+   *
+   * Returns ERROR, applying nothing, if any staged update failed or if another update changed one of the services
+   * since it was staged, in which case the transaction may be staged again. Otherwise returns CHANGED if any service
+   * changed.
+   */
+  StateUpdateResult commit(const String& originId) {
+    if (_failed) {
+      abort();
+      return StateUpdateResult::ERROR;
+    }
+
+    // lock in a consistent (address) order so concurrent transactions can not deadlock
+    size_t lockOrder[MAX_TRANSACTION_SERVICES];
+    sortByService(lockOrder);
+    for (size_t i = 0; i < _stagedCount; i++) {
+      _staged[lockOrder[i]]->lock();
+    }
+    bool current = true;
+    for (size_t i = 0; i < _stagedCount && current; i++) {
+      current = _staged[i]->isCurrent();
+    }
+    if (!current) {
+      for (size_t i = _stagedCount; i > 0; i--) {
+        _staged[lockOrder[i - 1]]->unlock();
+      }
+      abort();
+      return StateUpdateResult::ERROR;
+    }
+    bool changed = false;
+    for (size_t i = 0; i < _stagedCount; i++) {
+      _staged[i]->apply();
+      changed |= _staged[i]->result() == StateUpdateResult::CHANGED;
+    }
+    for (size_t i = _stagedCount; i > 0; i--) {
+      _staged[lockOrder[i - 1]]->unlock();
+    }
+
+    // propagate once per service, after every state has been replaced
+    for (size_t i = 0; i < _stagedCount; i++) {
+      _staged[i]->propagate(originId);
+    }
+    abort();
+    return changed ? StateUpdateResult::CHANGED : StateUpdateResult::UNCHANGED;
+  }
+
+  /**
+   * Discards all staged changes.
+   */
+  void abort() {
+    for (size_t i = 0; i < _stagedCount; i++) {
+      _staged[i].reset();
+    }
+    _stagedCount = 0;
+    _failed = false;
+  }
+
+ private:
+  std::unique_ptr<StagedStateUpdate> _staged[MAX_TRANSACTION_SERVICES];
+  size_t _stagedCount;
+  bool _failed;
+
+  template <class T>
+  TypedStagedStateUpdate<T>* stagedFor(StatefulService<T>* statefulService) {
+    for (size_t i = 0; i < _stagedCount; i++) {
+      if (_staged[i]->service() == statefulService) {
+        return static_cast<TypedStagedStateUpdate<T>*>(_staged[i].get());
+      }
+    }
+    if (_stagedCount >= MAX_TRANSACTION_SERVICES) {
+      return nullptr;
+    }
+    TypedStagedStateUpdate<T>* staged = new TypedStagedStateUpdate<T>(statefulService);
+    _staged[_stagedCount++].reset(staged);
+    return staged;
+  }
+
+  StateUpdateResult track(StateUpdateResult result) {
+    if (result == StateUpdateResult::ERROR) {
+      _failed = true;
+    }
+    return result;
+  }
+
+  void sortByService(size_t* order) {
+    std::less<const void*> before;
+    for (size_t i = 0; i < _stagedCount; i++) {
+      order[i] = i;
+      for (size_t j = i; j > 0 && before(_staged[order[j]]->service(), _staged[order[j - 1]]->service()); j--) {
+        std::swap(order[j], order[j - 1]);
+      }
+    }
+  }
+};
+
+#endif  // end StateTransaction_h
@@ -4,7 +4,8 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 
-#include <list>
+#include <InplaceFunction.h>
+
 #include <functional>
 #ifdef ESP32
 #include <freertos/FreeRTOS.h>
@@ -15,6 +16,10 @@
 #define DEFAULT_BUFFER_SIZE 1024
 #endif
 
+#ifndef MAX_UPDATE_HANDLERS
+#define MAX_UPDATE_HANDLERS 8
+#endif
+
 enum class StateUpdateResult {
   CHANGED = 0,  // The update changed the state and propagation should take place if required
   UNCHANGED,    // The state was unchanged, propagation should not take place
@@ -27,53 +32,102 @@ using JsonStateUpdater = std::function<StateUpdateResult(JsonObject& root, T& se
 template <typename T>
 using JsonStateReader = std::function<void(T& settings, JsonObject& root)>;
 
+/**
+ * Returns the capacity of the JSON document the state reader needs for the state.
+ */
+template <typename T>
+using JsonCapacityHint = std::function<size_t(T& settings)>;
+
 typedef size_t update_handler_id_t;
-typedef std::function<void(const String& originId)> StateUpdateCallback;
+typedef InplaceFunction<void(const String& originId)> StateUpdateCallback;
 
 typedef struct StateUpdateHandlerInfo {
   static update_handler_id_t currentUpdatedHandlerId;
   update_handler_id_t _id;
   StateUpdateCallback _cb;
   bool _allowRemove;
+  StateUpdateHandlerInfo() : _id(0), _cb(), _allowRemove(true){};
   StateUpdateHandlerInfo(StateUpdateCallback cb, bool allowRemove) :
       _id(++currentUpdatedHandlerId), _cb(cb), _allowRemove(allowRemove){};
 } StateUpdateHandlerInfo_t;
 
+template <class T>
+class TypedStagedStateUpdate;
+
 template <class T>
 class StatefulService {
  public:
   template <typename... Args>
 #ifdef ESP32
   StatefulService(Args&&... args) :
-      _state(std::forward<Args>(args)...), _accessMutex(xSemaphoreCreateRecursiveMutex()) {
+      _state(std::forward<Args>(args)...),
+      _accessMutex(xSemaphoreCreateRecursiveMutex()),
+      _updateHandlerCount(0),
+      _dispatchDepth(0),
+      _removalsPending(false),
+      _version(0) {
   }
 #else
-  StatefulService(Args&&... args) : _state(std::forward<Args>(args)...) {
+  StatefulService(Args&&... args) :
+      _state(std::forward<Args>(args)...),
+      _updateHandlerCount(0),
+      _dispatchDepth(0),
+      _removalsPending(false),
+      _version(0) {
   }
 #endif
 
+  /**
+   * Registers an update handler, returning its id. Handlers are held in a fixed size table of MAX_UPDATE_HANDLERS
+   * entries so registration never allocates. Returns 0 if the callback is empty or the table is full, callers must
+   * check for it.
+   */
   update_handler_id_t addUpdateHandler(StateUpdateCallback cb, bool allowRemove = true) {
     if (!cb) {
       return 0;
     }
-    StateUpdateHandlerInfo_t updateHandler(cb, allowRemove);
-    _updateHandlers.push_back(updateHandler);
-    return updateHandler._id;
+    beginTransaction();
+    if (_updateHandlerCount >= MAX_UPDATE_HANDLERS) {
+      endTransaction();
+      Serial.printf_P(PSTR("Update handler table full, raise MAX_UPDATE_HANDLERS (%d)\r\n"), MAX_UPDATE_HANDLERS);
+      return 0;
+    }
+    // the slot is filled before it is counted, handlers are called without the lock
+    StateUpdateHandlerInfo_t& updateHandler = _updateHandlers[_updateHandlerCount];
+    updateHandler = StateUpdateHandlerInfo_t(std::move(cb), allowRemove);
+    update_handler_id_t id = updateHandler._id;
+    _updateHandlerCount++;
+    endTransaction();
+    return id;
   }
 
+  /**
+   * Removes the handler. A handler removed while the handlers are being called, such as by itself, is skipped at once
+   * but only dropped from the table once the call is complete.
+   */
   void removeUpdateHandler(update_handler_id_t id) {
-    for (auto i = _updateHandlers.begin(); i != _updateHandlers.end();) {
-      if ((*i)._allowRemove && (*i)._id == id) {
-        i = _updateHandlers.erase(i);
-      } else {
-        ++i;
+    if (!id) {
+      return;
+    }
+    beginTransaction();
+    for (size_t i = 0; i < _updateHandlerCount; i++) {
+      if (_updateHandlers[i]._allowRemove && _updateHandlers[i]._id == id) {
+        _updateHandlers[i]._id = 0;
+        _removalsPending = true;
       }
     }
+    if (!_dispatchDepth) {
+      compactUpdateHandlers();
+    }
+    endTransaction();
   }
 
   StateUpdateResult update(std::function<StateUpdateResult(T&)> stateUpdater, const String& originId) {
     beginTransaction();
     StateUpdateResult result = stateUpdater(_state);
+    if (result == StateUpdateResult::CHANGED) {
+      _version++;
+    }
     endTransaction();
     if (result == StateUpdateResult::CHANGED) {
       callUpdateHandlers(originId);
@@ -84,6 +138,9 @@ class StatefulService {
   StateUpdateResult updateWithoutPropagation(std::function<StateUpdateResult(T&)> stateUpdater) {
     beginTransaction();
     StateUpdateResult result = stateUpdater(_state);
+    if (result == StateUpdateResult::CHANGED) {
+      _version++;
+    }
     endTransaction();
     return result;
   }
@@ -91,6 +148,9 @@ class StatefulService {
   StateUpdateResult update(JsonObject& jsonObject, JsonStateUpdater<T> stateUpdater, const String& originId) {
     beginTransaction();
     StateUpdateResult result = stateUpdater(jsonObject, _state);
+    if (result == StateUpdateResult::CHANGED) {
+      _version++;
+    }
     endTransaction();
     if (result == StateUpdateResult::CHANGED) {
       callUpdateHandlers(originId);
@@ -101,6 +161,9 @@ class StatefulService {
   StateUpdateResult updateWithoutPropagation(JsonObject& jsonObject, JsonStateUpdater<T> stateUpdater) {
     beginTransaction();
     StateUpdateResult result = stateUpdater(jsonObject, _state);
+    if (result == StateUpdateResult::CHANGED) {
+      _version++;
+    }
     endTransaction();
     return result;
   }
@@ -117,13 +180,56 @@ class StatefulService {
     endTransaction();
   }
 
+  /**
+   * Sizes the JSON documents the framework fills from the state, which otherwise use the buffer size they were given.
+   * A state of fixed shape can return a constant computed with JSON_OBJECT_SIZE, a state holding collections sizes
+   * itself from their lengths.
+   */
+  void setJsonCapacityHint(JsonCapacityHint<T> jsonCapacityHint) {
+    _jsonCapacityHint = jsonCapacityHint;
+  }
+
+  /**
+   * Returns the capacity needed to read the state, or the fallback if there is no hint. Called within read() the
+   * capacity holds for the state being read.
+   */
+  size_t getJsonCapacity(size_t fallback) {
+    if (!_jsonCapacityHint) {
+      return fallback;
+    }
+    beginTransaction();
+    size_t capacity = _jsonCapacityHint(_state);
+    endTransaction();
+    return capacity;
+  }
+
+  /**
+   * Returns a counter which is incremented once by every update which changes the state. It may be read without taking
+   * the lock, making it a cheap way to tell whether a previously read state is still current.
+   */
+  uint32_t getVersion() {
+    return _version;
+  }
+
   void callUpdateHandlers(const String& originId) {
-    for (const StateUpdateHandlerInfo_t& updateHandler : _updateHandlers) {
-      updateHandler._cb(originId);
+    beginTransaction();
+    _dispatchDepth++;
+    endTransaction();
+    for (size_t i = 0; i < _updateHandlerCount; i++) {
+      if (_updateHandlers[i]._id) {
+        _updateHandlers[i]._cb(originId);
+      }
     }
+    beginTransaction();
+    if (!--_dispatchDepth) {
+      compactUpdateHandlers();
+    }
+    endTransaction();
   }
 
  protected:
+  friend class TypedStagedStateUpdate<T>;
+
   T _state;
 
   inline void beginTransaction() {
@@ -142,7 +248,36 @@ class StatefulService {
 #ifdef ESP32
   SemaphoreHandle_t _accessMutex;
 #endif
-  std::list<StateUpdateHandlerInfo_t> _updateHandlers;
+  StateUpdateHandlerInfo_t _updateHandlers[MAX_UPDATE_HANDLERS];
+  size_t _updateHandlerCount;
+  uint8_t _dispatchDepth;
+  bool _removalsPending;
+  uint32_t _version;
+  JsonCapacityHint<T> _jsonCapacityHint;
+
+  /**
+   * Drops the removed handlers, preserving the registration order of the remaining ones. Called holding the lock.
+   */
+  void compactUpdateHandlers() {
+    if (!_removalsPending) {
+      return;
+    }
+    size_t retained = 0;
+    for (size_t i = 0; i < _updateHandlerCount; i++) {
+      if (!_updateHandlers[i]._id) {
+        continue;
+      }
+      if (retained != i) {
+        _updateHandlers[retained] = std::move(_updateHandlers[i]);
+      }
+      retained++;
+    }
+    for (size_t i = retained; i < _updateHandlerCount; i++) {
+      _updateHandlers[i] = StateUpdateHandlerInfo_t();
+    }
+    _updateHandlerCount = retained;
+    _removalsPending = false;
+  }
 };
 
 #endif  // end StatefulService_h
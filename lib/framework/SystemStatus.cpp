@@ -10,6 +10,12 @@ SystemStatus::SystemStatus(AsyncWebServer* server, SecurityManager* securityMana
 void SystemStatus::systemStatus(AsyncWebServerRequest* request) {
   AsyncJsonResponse* response = new AsyncJsonResponse(false, MAX_ESP_STATUS_SIZE);
   JsonObject root = response->getRoot();
+  readStatus(root);
+  response->setLength();
+  request->send(response);
+}
+
+void SystemStatus::readStatus(JsonObject& root) {
 #ifdef ESP32
   root["esp_platform"] = "esp32";
   root["max_alloc_heap"] = ESP.getMaxAllocHeap();
@@ -39,7 +45,4 @@ void SystemStatus::systemStatus(AsyncWebServerRequest* request) {
   root["fs_total"] = fs_info.totalBytes;
   root["fs_used"] = fs_info.usedBytes;
 #endif
-
-  response->setLength();
-  request->send(response);
 }
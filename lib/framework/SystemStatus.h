@@ -22,6 +22,8 @@ class SystemStatus {
  public:
   SystemStatus(AsyncWebServer* server, SecurityManager* securityManager);
 
+  void readStatus(JsonObject& root);
+
  private:
   void systemStatus(AsyncWebServerRequest* request);
 };
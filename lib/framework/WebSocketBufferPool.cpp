@@ -0,0 +1,199 @@
+#include <WebSocketBufferPool.h>
+
+// a frame's header: the opcode byte and the length, extended by two bytes for frames of 126 bytes or more
+#define WEB_SOCKET_FRAME_HEADER_SIZE 4
+#define WEB_SOCKET_FRAME_MAX_LENGTH 0xFFFF
+
+WebSocketBufferPool& WebSocketBufferPool::instance() {
+  static WebSocketBufferPool pool;
+  return pool;
+}
+
+WebSocketBufferPool::WebSocketBufferPool() :
+#ifdef ESP32
+    _accessMutex(xSemaphoreCreateRecursiveMutex()),
+#endif
+    _unpooled(0),
+    _hits(0),
+    _misses(0) {
+  for (size_t sizeClass = 0; sizeClass < WEB_SOCKET_BUFFER_POOL_CLASSES; sizeClass++) {
+    size_t capacity = WEB_SOCKET_BUFFER_POOL_MIN_SIZE << sizeClass;
+    for (size_t slot = 0; slot < WEB_SOCKET_BUFFER_POOL_SLOTS; slot++) {
+      uint8_t* data = new uint8_t[capacity + 1];
+      _buffers[sizeClass][slot] = {data, data ? capacity : 0, 0, 0, true};
+    }
+  }
+}
+
+WebSocketPoolBuffer* WebSocketBufferPool::acquire(size_t len) {
+  lock();
+  // a busy size class spills into the next one up
+  for (size_t sizeClass = 0; sizeClass < WEB_SOCKET_BUFFER_POOL_CLASSES; sizeClass++) {
+    for (size_t slot = 0; slot < WEB_SOCKET_BUFFER_POOL_SLOTS; slot++) {
+      WebSocketPoolBuffer* buffer = &_buffers[sizeClass][slot];
+      if (buffer->count == 0 && buffer->capacity >= len) {
+        buffer->length = len;
+        buffer->count = 1;
+        _hits++;
+        unlock();
+        return buffer;
+      }
+    }
+  }
+  _misses++;
+  unlock();
+  return nullptr;
+}
+
+WebSocketPoolBuffer* WebSocketBufferPool::makeBuffer(size_t len) {
+  WebSocketPoolBuffer* buffer = acquire(len);
+  if (buffer) {
+    return buffer;
+  }
+  uint8_t* data = new uint8_t[len + 1];
+  if (!data) {
+    return nullptr;
+  }
+  buffer = new WebSocketPoolBuffer{data, len, len, 1, false};
+  if (!buffer) {
+    delete[] data;
+    return nullptr;
+  }
+  lock();
+  _unpooled++;
+  unlock();
+  return buffer;
+}
+
+void WebSocketBufferPool::hold(WebSocketPoolBuffer* buffer) {
+  lock();
+  buffer->count++;
+  unlock();
+}
+
+void WebSocketBufferPool::release(WebSocketPoolBuffer* buffer) {
+  lock();
+  if (--buffer->count == 0 && !buffer->pooled) {
+    delete[] buffer->data;
+    delete buffer;
+    _unpooled--;
+  }
+  unlock();
+}
+
+WebSocketPoolBuffer* WebSocketBufferPool::makeTextBuffer(JsonObject root) {
+  size_t len = measureJson(root);
+  WebSocketPoolBuffer* buffer = makeBuffer(len);
+  if (buffer) {
+    serializeJson(root, (char*)buffer->data, len + 1);
+  }
+  return buffer;
+}
+
+void WebSocketBufferPool::text(AsyncWebSocketClient* client, WebSocketPoolBuffer* buffer) {
+  queue(client, buffer, WS_TEXT);
+}
+
+void WebSocketBufferPool::binary(AsyncWebSocketClient* client, WebSocketPoolBuffer* buffer) {
+  queue(client, buffer, WS_BINARY);
+}
+
+/**
+ * The client deletes the message, releasing the buffer, if it cannot be queued.
+ */
+void WebSocketBufferPool::queue(AsyncWebSocketClient* client, WebSocketPoolBuffer* buffer, uint8_t opcode) {
+  WebSocketPoolMessage* message = new WebSocketPoolMessage(buffer, opcode);
+  if (message) {
+    client->message(message);
+  }
+}
+
+void WebSocketBufferPool::readStatus(JsonObject& root) {
+  lock();
+  root["hits"] = _hits;
+  root["misses"] = _misses;
+  uint8_t free = 0;
+  for (size_t sizeClass = 0; sizeClass < WEB_SOCKET_BUFFER_POOL_CLASSES; sizeClass++) {
+    for (size_t slot = 0; slot < WEB_SOCKET_BUFFER_POOL_SLOTS; slot++) {
+      if (_buffers[sizeClass][slot].capacity && _buffers[sizeClass][slot].count == 0) {
+        free++;
+      }
+    }
+  }
+  root["free"] = free;
+  root["unpooled"] = _unpooled;
+  unlock();
+}
+
+WebSocketPoolMessage::WebSocketPoolMessage(WebSocketPoolBuffer* buffer, uint8_t opcode) :
+    _buffer(buffer), _sent(0), _ack(0), _acked(0) {
+  WebSocketBufferPool::instance().hold(_buffer);
+  _opcode = opcode;
+  _status = WS_MSG_SENDING;
+}
+
+WebSocketPoolMessage::~WebSocketPoolMessage() {
+  WebSocketBufferPool::instance().release(_buffer);
+}
+
+void WebSocketPoolMessage::ack(size_t len, uint32_t time) {
+  _acked += len;
+  if (_sent >= _buffer->length && _acked >= _ack) {
+    _status = WS_MSG_SENT;
+  }
+}
+
+/**
+ * Sends as much of the buffer as the connection has room for as the next frame, once the previous frame has been
+ * acknowledged. Server frames are never masked.
+ */
+size_t WebSocketPoolMessage::send(AsyncClient* client) {
+  if (_status != WS_MSG_SENDING || _acked < _ack) {
+    return 0;
+  }
+  size_t length = _buffer->length;
+  if (_sent >= length) {
+    _status = WS_MSG_SENT;
+    return 0;
+  }
+  size_t space = client->canSend() ? client->space() : 0;
+  if (space <= WEB_SOCKET_FRAME_HEADER_SIZE) {
+    return 0;
+  }
+  size_t toSend = length - _sent;
+  if (toSend > space - WEB_SOCKET_FRAME_HEADER_SIZE) {
+    toSend = space - WEB_SOCKET_FRAME_HEADER_SIZE;
+  }
+  if (toSend > WEB_SOCKET_FRAME_MAX_LENGTH) {
+    toSend = WEB_SOCKET_FRAME_MAX_LENGTH;
+  }
+
+  uint8_t header[WEB_SOCKET_FRAME_HEADER_SIZE];
+  size_t headerLength = 2;
+  header[0] = (_sent ? WS_CONTINUATION : _opcode) | (_sent + toSend == length ? 0x80 : 0);
+  if (toSend < 126) {
+    header[1] = toSend;
+  } else {
+    header[1] = 126;
+    header[2] = toSend >> 8;
+    header[3] = toSend;
+    headerLength = 4;
+  }
+  if (client->add((const char*)header, headerLength) != headerLength ||
+      client->add((const char*)_buffer->data + _sent, toSend) != toSend || !client->send()) {
+    // a frame which was only partly queued leaves the connection unusable
+    _status = WS_MSG_ERROR;
+    client->close(true);
+    return 0;
+  }
+  _sent += toSend;
+  _ack += headerLength + toSend;
+  return toSend;
+}
+
+/**
+ * Control frames may be sent in between the frames of a message once each frame has been acknowledged.
+ */
+bool WebSocketPoolMessage::betweenFrames() const {
+  return _acked == _ack;
+}
@@ -0,0 +1,126 @@
+#ifndef WebSocketBufferPool_h
+#define WebSocketBufferPool_h
+
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+
+// size classes double from the smallest, 128, 256, 512 and 1024 bytes by default
+#ifndef WEB_SOCKET_BUFFER_POOL_MIN_SIZE
+#define WEB_SOCKET_BUFFER_POOL_MIN_SIZE 128
+#endif
+
+#ifndef WEB_SOCKET_BUFFER_POOL_CLASSES
+#define WEB_SOCKET_BUFFER_POOL_CLASSES 4
+#endif
+
+#ifndef WEB_SOCKET_BUFFER_POOL_SLOTS
+#define WEB_SOCKET_BUFFER_POOL_SLOTS 2
+#endif
+
+/**
+ * A buffer handed out by the pool, frames are sent from its first length bytes. The data holds one byte more than the
+ * capacity, for the null terminator of text frames.
+ */
+struct WebSocketPoolBuffer {
+  uint8_t* data;
+  size_t capacity;
+  size_t length;
+  uint32_t count;
+  bool pooled;
+};
+
+/**
+ * A pool of WebSocket message buffers allocated at startup in size classes and shared by every WebSocket endpoint.
+ *
+ * A buffer's storage is allocated once and never resized, messages shorter than the buffer are sent from it at their
+ * own length. The library's message buffers always send their whole allocation and reallocate to change it, so frames
+ * are queued as messages of our own, which send from the pooled storage and drop their hold on the buffer once the
+ * library deletes them. A buffer is free for reuse once every queued message referencing it has been sent.
+ *
+ * Messages which find no free buffer large enough get a buffer of their own, deleted as soon as the last message
+ * referencing it is done with it.
+ */
+class WebSocketBufferPool {
+ public:
+  static WebSocketBufferPool& instance();
+
+  /**
+   * Returns a free pooled buffer holding len bytes, or nullptr if none is free. The buffer is held for the caller until
+   * it is passed to release().
+   */
+  WebSocketPoolBuffer* acquire(size_t len);
+
+  /**
+   * Returns a buffer of len bytes, from the pool if one is free and otherwise one of its own, or nullptr if out of
+   * memory. The buffer is held for the caller until it is passed to release().
+   */
+  WebSocketPoolBuffer* makeBuffer(size_t len);
+
+  /**
+   * Drops a hold on a buffer obtained from acquire() or makeBuffer().
+   */
+  void release(WebSocketPoolBuffer* buffer);
+
+  /**
+   * Serializes JSON into a buffer from makeBuffer(). The returned buffer is held and must be released once it has been
+   * queued.
+   */
+  WebSocketPoolBuffer* makeTextBuffer(JsonObject root);
+
+  /**
+   * Queues the buffer's content as a text or binary message. The message holds the buffer until it has been sent.
+   */
+  void text(AsyncWebSocketClient* client, WebSocketPoolBuffer* buffer);
+  void binary(AsyncWebSocketClient* client, WebSocketPoolBuffer* buffer);
+
+  void readStatus(JsonObject& root);
+
+ private:
+#ifdef ESP32
+  SemaphoreHandle_t _accessMutex;
+#endif
+  WebSocketPoolBuffer _buffers[WEB_SOCKET_BUFFER_POOL_CLASSES][WEB_SOCKET_BUFFER_POOL_SLOTS];
+  uint32_t _unpooled;
+  uint32_t _hits;
+  uint32_t _misses;
+
+  friend class WebSocketPoolMessage;
+
+  WebSocketBufferPool();
+  void hold(WebSocketPoolBuffer* buffer);
+  void queue(AsyncWebSocketClient* client, WebSocketPoolBuffer* buffer, uint8_t opcode);
+
+  inline void lock() {
+#ifdef ESP32
+    xSemaphoreTakeRecursive(_accessMutex, portMAX_DELAY);
+#endif
+  }
+
+  inline void unlock() {
+#ifdef ESP32
+    xSemaphoreGiveRecursive(_accessMutex);
+#endif
+  }
+};
+
+/**
+ * Sends a pooled buffer as one WebSocket message, split into frames as the connection has room, releasing the buffer
+ * once the library deletes the message.
+ */
+class WebSocketPoolMessage : public AsyncWebSocketMessage {
+ public:
+  WebSocketPoolMessage(WebSocketPoolBuffer* buffer, uint8_t opcode);
+  virtual ~WebSocketPoolMessage();
+
+  virtual void ack(size_t len, uint32_t time);
+  virtual size_t send(AsyncClient* client);
+  virtual bool betweenFrames() const;
+
+ private:
+  WebSocketPoolBuffer* _buffer;
+  size_t _sent;
+  size_t _ack;
+  size_t _acked;
+};
+
+#endif  // end WebSocketBufferPool_h
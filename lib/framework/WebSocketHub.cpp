@@ -0,0 +1,352 @@
+#include <WebSocketHub.h>
+
+WebSocketHub::WebSocketHub(AsyncWebServer* server,
+                           SecurityManager* securityManager,
+                           AuthenticationPredicate authenticationPredicate,
+                           size_t bufferSize) :
+#ifdef ESP32
+    _accessMutex(xSemaphoreCreateRecursiveMutex()),
+#endif
+    _securityManager(securityManager), _webSocket(WEB_SOCKET_HUB_PATH), _bufferSize(bufferSize), _channelCount(0) {
+  _webSocket.setFilter(securityManager->filterRequest(authenticationPredicate));
+  _webSocket.onEvent(std::bind(&WebSocketHub::onWSEvent,
+                               this,
+                               std::placeholders::_1,
+                               std::placeholders::_2,
+                               std::placeholders::_3,
+                               std::placeholders::_4,
+                               std::placeholders::_5,
+                               std::placeholders::_6));
+  server->addHandler(&_webSocket);
+  server->on(WEB_SOCKET_HUB_PATH, HTTP_GET, std::bind(&WebSocketHub::forbidden, this, std::placeholders::_1));
+  WebSocketBufferPool::instance();
+}
+
+int8_t WebSocketHub::addStatusChannel(const char* name,
+                                      JsonStatusReader statusReader,
+                                      uint32_t interval,
+                                      AuthenticationPredicate authenticationPredicate) {
+  return addChannel(new StatusHubChannel(name, authenticationPredicate, statusReader, interval));
+}
+
+void WebSocketHub::loop() {
+  lock();
+  for (uint8_t channel = 0; channel < _channelCount; channel++) {
+    if (_channels[channel]->isDue()) {
+      transmitChannel(channel, nullptr, WEB_SOCKET_HUB_ORIGIN);
+    }
+  }
+  forEachClient([&](AsyncWebSocketClient* client, WebSocketHubSession& session) {
+    for (uint8_t channel = 0; channel < _channelCount && session.staleChannels; channel++) {
+      if (client->queueIsFull()) {
+        return;
+      }
+      if (session.staleChannels & ((uint32_t)1 << channel)) {
+        transmitChannel(channel, client, WEB_SOCKET_HUB_ORIGIN);
+      }
+    }
+  });
+  unlock();
+}
+
+int8_t WebSocketHub::addChannel(WebSocketHubChannel* channel) {
+  if (_channelCount >= WEB_SOCKET_HUB_MAX_CHANNELS) {
+    delete channel;
+    return -1;
+  }
+  _channels[_channelCount].reset(channel);
+  return _channelCount++;
+}
+
+int8_t WebSocketHub::findChannel(JsonVariant channel) {
+  if (channel.is<const char*>()) {
+    const char* name = channel.as<const char*>();
+    for (uint8_t i = 0; i < _channelCount; i++) {
+      if (strcmp(_channels[i]->getName(), name) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  int id = channel | -1;
+  return id >= 0 && id < _channelCount ? id : -1;
+}
+
+void WebSocketHub::forbidden(AsyncWebServerRequest* request) {
+  request->send(403);
+}
+
+void WebSocketHub::onWSEvent(AsyncWebSocket* server,
+                             AsyncWebSocketClient* client,
+                             AwsEventType type,
+                             void* arg,
+                             uint8_t* data,
+                             size_t len) {
+  lock();
+  if (type == WS_EVT_CONNECT) {
+    WebSocketHubSession* clientSession = openSession(client, (AsyncWebServerRequest*)arg);
+    if (!clientSession) {
+      unlock();
+      client->close();
+      return;
+    }
+    transmitId(client);
+    transmitChannels(client, *clientSession);
+    uint32_t channels = clientSession->subscribedChannels;
+    clientSession->subscribedChannels = 0;
+    subscribe(client, *clientSession, channels);
+  } else if (type == WS_EVT_DISCONNECT) {
+    WebSocketHubSession* clientSession = session(client);
+    if (clientSession) {
+      clientSession->releaseMessage();
+      *clientSession = WebSocketHubSession();
+    }
+  } else if (type == WS_EVT_DATA) {
+    WebSocketHubSession* clientSession = session(client);
+    AwsFrameInfo* info = (AwsFrameInfo*)arg;
+    if (!clientSession) {
+      // the client was refused a session
+    } else if (info->final && info->index == 0 && info->len == len && info->num == 0) {
+      if (info->opcode == WS_TEXT) {
+        receiveMessage(client, *clientSession, data, len);
+      }
+    } else if (clientSession->receiveFragment(info, data, len)) {
+      if (clientSession->messageOpcode == WS_TEXT) {
+        receiveMessage(client, *clientSession, clientSession->message, clientSession->messageLength);
+      }
+      clientSession->releaseMessage();
+    }
+  }
+  unlock();
+}
+
+WebSocketHubSession* WebSocketHub::openSession(AsyncWebSocketClient* client, AsyncWebServerRequest* request) {
+  for (WebSocketHubSession& session : _sessions) {
+    if (!session.clientId) {
+      session = WebSocketHubSession();
+      session.clientId = client->id();
+      session.permittedChannels = permittedChannels(request);
+      session.subscribedChannels = session.permittedChannels;
+      if (request && request->hasParam(WEB_SOCKET_HUB_CHANNELS_PARAM)) {
+        session.subscribedChannels &= parseChannels(request->getParam(WEB_SOCKET_HUB_CHANNELS_PARAM)->value());
+      }
+      return &session;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Evaluates each channel's authentication predicate against the credentials the client connected with.
+ */
+uint32_t WebSocketHub::permittedChannels(AsyncWebServerRequest* request) {
+  uint32_t channels = 0;
+  if (request) {
+    Authentication authentication = _securityManager->authenticateRequest(request);
+    for (uint8_t channel = 0; channel < _channelCount; channel++) {
+      if (_channels[channel]->isPermitted(authentication)) {
+        channels |= (uint32_t)1 << channel;
+      }
+    }
+  }
+  return channels;
+}
+
+WebSocketHubSession* WebSocketHub::session(AsyncWebSocketClient* client) {
+  for (WebSocketHubSession& session : _sessions) {
+    if (session.clientId == client->id()) {
+      return &session;
+    }
+  }
+  return nullptr;
+}
+
+uint32_t WebSocketHub::parseChannels(const String& channelList) {
+  uint32_t channels = 0;
+  int start = 0;
+  while (start <= (int)channelList.length()) {
+    int end = channelList.indexOf(',', start);
+    if (end < 0) {
+      end = channelList.length();
+    }
+    String name = channelList.substring(start, end);
+    name.trim();
+    for (uint8_t channel = 0; channel < _channelCount; channel++) {
+      if (name == _channels[channel]->getName() || name == String(channel)) {
+        channels |= (uint32_t)1 << channel;
+      }
+    }
+    start = end + 1;
+  }
+  return channels;
+}
+
+void WebSocketHub::receiveMessage(AsyncWebSocketClient* client,
+                                  WebSocketHubSession& session,
+                                  uint8_t* data,
+                                  size_t len) {
+  DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
+  DeserializationError error = deserializeJson(jsonDocument, (char*)data, len);
+  if (error || !jsonDocument.is<JsonObject>()) {
+    return;
+  }
+  JsonObject root = jsonDocument.as<JsonObject>();
+  String type = root["type"] | "";
+  if (type == "subscribe") {
+    uint32_t channels = 0;
+    for (JsonVariant channel : root["channels"].as<JsonArray>()) {
+      int8_t id = findChannel(channel);
+      if (id >= 0) {
+        channels |= (uint32_t)1 << id;
+      }
+    }
+    subscribe(client, session, channels);
+  } else if (type == "update") {
+    int8_t channel = findWritableChannel(session, root);
+    if (channel < 0) {
+      return;
+    }
+    JsonObject payload = root["payload"].as<JsonObject>();
+    _channels[channel]->update(payload, clientId(client));
+  } else if (type == "updates") {
+    updateChannels(client, session, root["updates"].as<JsonArray>());
+  }
+}
+
+/**
+ * Returns the channel an update is for, or -1 if the client may not write to it or there is no payload.
+ */
+int8_t WebSocketHub::findWritableChannel(WebSocketHubSession& session, JsonVariant update) {
+  int8_t channel = findChannel(update["channel"]);
+  if (channel < 0 || !(session.permittedChannels & ((uint32_t)1 << channel)) || !_channels[channel]->isWritable() ||
+      !update["payload"].is<JsonObject>()) {
+    return -1;
+  }
+  return channel;
+}
+
+/**
+ * Applies updates to several channels as a single transaction, none are applied if any of them is refused.
+ */
+void WebSocketHub::updateChannels(AsyncWebSocketClient* client, WebSocketHubSession& session, JsonArray updates) {
+  StateTransaction transaction;
+  for (JsonVariant update : updates) {
+    int8_t channel = findWritableChannel(session, update);
+    if (channel < 0) {
+      return;
+    }
+    JsonObject payload = update["payload"].as<JsonObject>();
+    _channels[channel]->stage(transaction, payload);
+  }
+  transaction.commit(clientId(client));
+}
+
+void WebSocketHub::subscribe(AsyncWebSocketClient* client, WebSocketHubSession& session, uint32_t channels) {
+  channels &= session.permittedChannels;
+  uint32_t added = channels & ~session.subscribedChannels;
+  session.subscribedChannels = channels;
+  session.staleChannels &= channels;
+  for (uint8_t channel = 0; channel < _channelCount; channel++) {
+    if (added & ((uint32_t)1 << channel)) {
+      transmitChannel(channel, client, WEB_SOCKET_HUB_ORIGIN);
+    }
+  }
+}
+
+void WebSocketHub::transmitId(AsyncWebSocketClient* client) {
+  StaticJsonDocument<WEB_SOCKET_CLIENT_ID_MSG_SIZE> jsonDocument;
+  JsonObject root = jsonDocument.to<JsonObject>();
+  root["type"] = "id";
+  root["id"] = clientId(client);
+  transmit(client, root);
+}
+
+void WebSocketHub::transmitChannels(AsyncWebSocketClient* client, WebSocketHubSession& session) {
+  DynamicJsonDocument jsonDocument = DynamicJsonDocument(_bufferSize);
+  JsonObject root = jsonDocument.to<JsonObject>();
+  root["type"] = "channels";
+  JsonArray channels = root.createNestedArray("channels");
+  for (uint8_t channel = 0; channel < _channelCount; channel++) {
+    if (session.permittedChannels & ((uint32_t)1 << channel)) {
+      JsonObject channelJson = channels.createNestedObject();
+      channelJson["id"] = channel;
+      channelJson["name"] = _channels[channel]->getName();
+      channelJson["writable"] = _channels[channel]->isWritable();
+    }
+  }
+  transmit(client, root);
+}
+
+/**
+ * Sends the channel's payload to the client, if provided. Otherwise sends it to every subscribed client except the
+ * client the update originated from. The channel is only read if at least one client will receive it and is
+ * serialized once into a shared buffer.
+ *
+ * Called from the update handlers of the services, on whichever task updated them, so the whole transmission holds
+ * the lock.
+ */
+void WebSocketHub::transmitChannel(uint8_t channel, AsyncWebSocketClient* client, const String& originId) {
+  lock();
+  uint32_t channelMask = (uint32_t)1 << channel;
+  uint32_t excludedId = 0;
+  if (!client && originId.startsWith(WEB_SOCKET_HUB_ORIGIN_CLIENT_ID_PREFIX)) {
+    excludedId = strtoul(originId.c_str() + strlen(WEB_SOCKET_HUB_ORIGIN_CLIENT_ID_PREFIX), nullptr, 10);
+  }
+  bool subscribed = false;
+  forEachClient([&](AsyncWebSocketClient* subscriber, WebSocketHubSession& session) {
+    subscribed |= (!client || subscriber == client) && subscriber->id() != excludedId &&
+                  (session.subscribedChannels & channelMask);
+  });
+  if (!subscribed) {
+    unlock();
+    return;
+  }
+
+  // the message wraps the channel's payload, whose origin id is copied into the document
+  size_t capacity = JSON_OBJECT_SIZE(4) + originId.length() + 1 + _channels[channel]->getJsonCapacity(_bufferSize);
+  DynamicJsonDocument jsonDocument = DynamicJsonDocument(capacity);
+  JsonObject root = jsonDocument.to<JsonObject>();
+  root["type"] = "payload";
+  root["channel"] = channel;
+  root["origin_id"] = originId;
+  JsonObject payload = root.createNestedObject("payload");
+  _channels[channel]->read(payload);
+  if (jsonDocument.overflowed()) {
+    Serial.printf_P(PSTR("Channel %s overflowed its JSON buffer and was not sent\r\n"), _channels[channel]->getName());
+    unlock();
+    return;
+  }
+
+  WebSocketPoolBuffer* buffer = nullptr;
+  forEachClient([&](AsyncWebSocketClient* subscriber, WebSocketHubSession& session) {
+    if ((client && subscriber != client) || subscriber->id() == excludedId ||
+        !(session.subscribedChannels & channelMask)) {
+      return;
+    }
+    if (subscriber->queueIsFull()) {
+      session.staleChannels |= channelMask;
+      session.coalesced++;
+      return;
+    }
+    if (!buffer) {
+      buffer = WebSocketBufferPool::instance().makeTextBuffer(root);
+    }
+    if (buffer) {
+      WebSocketBufferPool::instance().text(subscriber, buffer);
+      session.staleChannels &= ~channelMask;
+      session.sent++;
+    }
+  });
+  if (buffer) {
+    WebSocketBufferPool::instance().release(buffer);
+  }
+  unlock();
+}
+
+void WebSocketHub::transmit(AsyncWebSocketClient* client, JsonObject root) {
+  WebSocketPoolBuffer* buffer = WebSocketBufferPool::instance().makeTextBuffer(root);
+  if (buffer) {
+    WebSocketBufferPool::instance().text(client, buffer);
+    WebSocketBufferPool::instance().release(buffer);
+  }
+}
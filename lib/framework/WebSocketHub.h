@@ -0,0 +1,302 @@
+#ifndef WebSocketHub_h
+#define WebSocketHub_h
+
+#include <StateTransaction.h>
+#include <WebSocketTxRx.h>
+
+#include <memory>
+
+#define WEB_SOCKET_HUB_PATH "/ws/hub"
+#define WEB_SOCKET_HUB_ORIGIN "hub"
+#define WEB_SOCKET_HUB_ORIGIN_CLIENT_ID_PREFIX "hub:"
+
+// clients may pick the channels they start with by connecting with "?channels=wifiStatus,rgbLight", ids also work
+#define WEB_SOCKET_HUB_CHANNELS_PARAM "channels"
+
+#ifndef WEB_SOCKET_HUB_MAX_CHANNELS
+#define WEB_SOCKET_HUB_MAX_CHANNELS 16
+#endif
+
+#ifndef WEB_SOCKET_HUB_STATUS_INTERVAL
+#define WEB_SOCKET_HUB_STATUS_INTERVAL 2000
+#endif
+
+// channels are tracked in 32 bit masks
+static_assert(WEB_SOCKET_HUB_MAX_CHANNELS <= 32, "WEB_SOCKET_HUB_MAX_CHANNELS must not exceed 32");
+
+typedef std::function<void(JsonObject& root)> JsonStatusReader;
+
+/**
+ * A stream of JSON carried over the hub, read when subscribers need it and optionally writable.
+ */
+class WebSocketHubChannel {
+ public:
+  WebSocketHubChannel(const char* name, AuthenticationPredicate authenticationPredicate) :
+      _name(name), _authenticationPredicate(authenticationPredicate) {
+  }
+
+  virtual ~WebSocketHubChannel() {
+  }
+
+  const char* getName() {
+    return _name;
+  }
+
+  bool isPermitted(Authentication& authentication) {
+    return _authenticationPredicate(authentication);
+  }
+
+  virtual void read(JsonObject& root) = 0;
+
+  /**
+   * Returns the capacity needed to read the channel, or the fallback if the channel does not know.
+   */
+  virtual size_t getJsonCapacity(size_t fallback) {
+    return fallback;
+  }
+
+  virtual bool isWritable() {
+    return false;
+  }
+
+  virtual StateUpdateResult update(JsonObject& root, const String& originId) {
+    return StateUpdateResult::ERROR;
+  }
+
+  /**
+   * Stages an update in the transaction, to be applied along with the transaction's other updates.
+   */
+  virtual StateUpdateResult stage(StateTransaction& transaction, JsonObject& root) {
+    return StateUpdateResult::ERROR;
+  }
+
+  /**
+   * Returns true if the channel should be pushed to subscribers without having been updated.
+   */
+  virtual bool isDue() {
+    return false;
+  }
+
+ private:
+  const char* _name;
+  AuthenticationPredicate _authenticationPredicate;
+};
+
+template <class T>
+class StatefulHubChannel : public WebSocketHubChannel {
+ public:
+  StatefulHubChannel(const char* name,
+                     AuthenticationPredicate authenticationPredicate,
+                     StatefulService<T>* statefulService,
+                     JsonStateReader<T> stateReader,
+                     JsonStateUpdater<T> stateUpdater) :
+      WebSocketHubChannel(name, authenticationPredicate),
+      _statefulService(statefulService),
+      _stateReader(stateReader),
+      _stateUpdater(stateUpdater) {
+  }
+
+  void read(JsonObject& root) {
+    _statefulService->read(root, _stateReader);
+  }
+
+  size_t getJsonCapacity(size_t fallback) {
+    return _statefulService->getJsonCapacity(fallback);
+  }
+
+  bool isWritable() {
+    return (bool)_stateUpdater;
+  }
+
+  StateUpdateResult update(JsonObject& root, const String& originId) {
+    return _statefulService->update(root, _stateUpdater, originId);
+  }
+
+  StateUpdateResult stage(StateTransaction& transaction, JsonObject& root) {
+    return transaction.update(_statefulService, root, _stateUpdater);
+  }
+
+ private:
+  StatefulService<T>* _statefulService;
+  JsonStateReader<T> _stateReader;
+  JsonStateUpdater<T> _stateUpdater;
+};
+
+class StatusHubChannel : public WebSocketHubChannel {
+ public:
+  StatusHubChannel(const char* name,
+                   AuthenticationPredicate authenticationPredicate,
+                   JsonStatusReader statusReader,
+                   uint32_t interval) :
+      WebSocketHubChannel(name, authenticationPredicate),
+      _statusReader(statusReader),
+      _interval(interval),
+      _lastRead(0) {
+  }
+
+  void read(JsonObject& root) {
+    _lastRead = millis();
+    _statusReader(root);
+  }
+
+  bool isDue() {
+    return (uint32_t)(millis() - _lastRead) >= _interval;
+  }
+
+ private:
+  JsonStatusReader _statusReader;
+  uint32_t _interval;
+  uint32_t _lastRead;
+};
+
+/**
+ * Per client state of the hub, extends the WebSocket session with channel permissions and subscriptions.
+ */
+struct WebSocketHubSession : public WebSocketClientSession {
+  uint32_t permittedChannels;
+  uint32_t subscribedChannels;
+  uint32_t staleChannels;
+
+  WebSocketHubSession() : permittedChannels(0), subscribedChannels(0), staleChannels(0) {
+  }
+};
+
+/**
+ * Carries any number of StatefulServices and status streams over a single WebSocket, so a browser needs one
+ * connection (and one authentication pass) rather than one per service.
+ *
+ * Every message is a JSON object with a "type". On connecting the client is sent its "id" and a "channels" directory
+ * listing the channels its credentials permit, followed by a "payload" for each subscribed channel:
+ *
+ *   {"type":"payload","channel":0,"origin_id":"http","payload":{...}}
+ *
+ * Clients change their subscriptions with {"type":"subscribe","channels":[0,"wifiStatus"]} and update writable
+ * channels with {"type":"update","channel":0,"payload":{...}}. Service channels are pushed as they change, updates
+ * are not echoed to the client which sent them. Status channels are read and pushed every interval while subscribed.
+ */
+class WebSocketHub {
+  // prevents the reader and updater from taking part in template argument deduction
+  template <typename U>
+  struct ChannelCallback {
+    typedef U type;
+  };
+
+ public:
+  WebSocketHub(AsyncWebServer* server,
+               SecurityManager* securityManager,
+               AuthenticationPredicate authenticationPredicate = AuthenticationPredicates::IS_AUTHENTICATED,
+               size_t bufferSize = DEFAULT_BUFFER_SIZE);
+
+  /**
+   * Adds a channel for a StatefulService, writable if an updater is given. Returns the channel id or -1 if the hub
+   * or the service's update handler table is full.
+   */
+  template <class T>
+  int8_t addChannel(const char* name,
+                    StatefulService<T>* statefulService,
+                    typename ChannelCallback<JsonStateReader<T>>::type stateReader,
+                    typename ChannelCallback<JsonStateUpdater<T>>::type stateUpdater = nullptr,
+                    AuthenticationPredicate authenticationPredicate = AuthenticationPredicates::IS_ADMIN) {
+    int8_t channel = addChannel(
+        new StatefulHubChannel<T>(name, authenticationPredicate, statefulService, stateReader, stateUpdater));
+    if (channel < 0) {
+      return -1;
+    }
+    update_handler_id_t handlerId = statefulService->addUpdateHandler(
+        [this, channel](const String& originId) { transmitChannel(channel, nullptr, originId); }, false);
+    if (!handlerId) {
+      // the channel was added last, and nobody can have subscribed to it yet
+      _channels[--_channelCount].reset();
+      return -1;
+    }
+    return channel;
+  }
+
+  /**
+   * Adds a read only channel which is pushed to subscribers every interval (ms). Returns the channel id or -1 if the
+   * hub is full.
+   */
+  int8_t addStatusChannel(const char* name,
+                          JsonStatusReader statusReader,
+                          uint32_t interval = WEB_SOCKET_HUB_STATUS_INTERVAL,
+                          AuthenticationPredicate authenticationPredicate = AuthenticationPredicates::IS_AUTHENTICATED);
+
+  /**
+   * Pushes status channels which are due and catches up clients which missed updates while their queue was full.
+   */
+  void loop();
+
+ private:
+#ifdef ESP32
+  SemaphoreHandle_t _accessMutex;
+#endif
+  SecurityManager* _securityManager;
+  AsyncWebSocket _webSocket;
+  size_t _bufferSize;
+  std::unique_ptr<WebSocketHubChannel> _channels[WEB_SOCKET_HUB_MAX_CHANNELS];
+  uint8_t _channelCount;
+  WebSocketHubSession _sessions[WEB_SOCKET_MAX_CLIENTS];
+
+  int8_t addChannel(WebSocketHubChannel* channel);
+  int8_t findChannel(JsonVariant channel);
+
+  void forbidden(AsyncWebServerRequest* request);
+  void onWSEvent(AsyncWebSocket* server,
+                 AsyncWebSocketClient* client,
+                 AwsEventType type,
+                 void* arg,
+                 uint8_t* data,
+                 size_t len);
+
+  WebSocketHubSession* openSession(AsyncWebSocketClient* client, AsyncWebServerRequest* request);
+  uint32_t permittedChannels(AsyncWebServerRequest* request);
+  WebSocketHubSession* session(AsyncWebSocketClient* client);
+  uint32_t parseChannels(const String& channelList);
+
+  void receiveMessage(AsyncWebSocketClient* client, WebSocketHubSession& session, uint8_t* data, size_t len);
+  void subscribe(AsyncWebSocketClient* client, WebSocketHubSession& session, uint32_t channels);
+  int8_t findWritableChannel(WebSocketHubSession& session, JsonVariant update);
+  void updateChannels(AsyncWebSocketClient* client, WebSocketHubSession& session, JsonArray updates);
+
+  void transmitId(AsyncWebSocketClient* client);
+  void transmitChannels(AsyncWebSocketClient* client, WebSocketHubSession& session);
+  void transmitChannel(uint8_t channel, AsyncWebSocketClient* client, const String& originId);
+  void transmit(AsyncWebSocketClient* client, JsonObject root);
+
+  String clientId(AsyncWebSocketClient* client) {
+    return WEB_SOCKET_HUB_ORIGIN_CLIENT_ID_PREFIX + String(client->id());
+  }
+
+  template <typename F>
+  void forEachClient(F fn) {
+    lock();
+    for (WebSocketHubSession& session : _sessions) {
+      if (session.clientId) {
+        AsyncWebSocketClient* client = _webSocket.client(session.clientId);
+        if (client && client->status() == WS_CONNECTED) {
+          fn(client, session);
+        }
+      }
+    }
+    unlock();
+  }
+
+  /**
+   * Serializes access to the sessions and the clients between the main loop, the async web server and the tasks
+   * updating the services. A client is not removed by the library until its disconnect event, which takes the lock,
+   * has returned.
+   */
+  inline void lock() {
+#ifdef ESP32
+    xSemaphoreTakeRecursive(_accessMutex, portMAX_DELAY);
+#endif
+  }
+
+  inline void unlock() {
+#ifdef ESP32
+    xSemaphoreGiveRecursive(_accessMutex);
+#endif
+  }
+};
+
+#endif  // end WebSocketHub_h
@@ -4,12 +4,139 @@
 #include <StatefulService.h>
 #include <ESPAsyncWebServer.h>
 #include <SecurityManager.h>
+#include <WebSocketBufferPool.h>
 
 #define WEB_SOCKET_CLIENT_ID_MSG_SIZE 128
 
 #define WEB_SOCKET_ORIGIN "websocket"
 #define WEB_SOCKET_ORIGIN_CLIENT_ID_PREFIX "websocket:"
 
+// clients may request binary (MessagePack) framing by connecting with "?format=msgpack"
+#define WEB_SOCKET_FORMAT_PARAM "format"
+#define WEB_SOCKET_FORMAT_MSGPACK "msgpack"
+
+// clients may limit payloads to a subset of the state's top level keys by connecting with "?topics=color,pins"
+#define WEB_SOCKET_TOPICS_PARAM "topics"
+#define WEB_SOCKET_MAX_TOPICS 32
+
+// the first byte of a binary frame sent to the client identifies the message, the remainder is MessagePack
+#define WEB_SOCKET_BINARY_ID 0x01
+#define WEB_SOCKET_BINARY_PAYLOAD 0x02
+
+#ifndef WEB_SOCKET_MAX_CLIENTS
+#ifdef DEFAULT_MAX_WS_CLIENTS
+#define WEB_SOCKET_MAX_CLIENTS DEFAULT_MAX_WS_CLIENTS
+#else
+#define WEB_SOCKET_MAX_CLIENTS 8
+#endif
+#endif
+
+enum class WebSocketFormat : uint8_t {
+  JSON = 0,  // JSON text frames with a type/origin_id/payload envelope
+  MSGPACK    // binary frames, a message type byte followed by MessagePack values
+};
+
+// minimum time between broadcasts in ms, changes within the window are sent as one trailing broadcast (0 disables)
+#ifndef WEB_SOCKET_BROADCAST_INTERVAL
+#define WEB_SOCKET_BROADCAST_INTERVAL 0
+#endif
+
+#ifndef WEB_SOCKET_MAX_MESSAGE_SIZE
+#define WEB_SOCKET_MAX_MESSAGE_SIZE 4096
+#endif
+
+/**
+ * Per client state, held in a fixed size table owned by the connector.
+ */
+struct WebSocketClientSession {
+  uint32_t clientId;
+  WebSocketFormat format;
+
+  // reassembly of messages which arrive in more than one piece
+  uint8_t* message;
+  size_t messageLength;
+  size_t messageCapacity;
+  uint8_t messageOpcode;
+  bool messageDiscarded;
+
+  // backpressure, set while the client is known to be missing the latest payload
+  bool stale;
+  uint32_t sent;
+  uint32_t coalesced;
+
+  // bitmask of subscribed topics (0 for the whole state) and a hash of the subscribed content last sent
+  uint32_t topics;
+  uint32_t topicsHash;
+
+  WebSocketClientSession() :
+      clientId(0),
+      format(WebSocketFormat::JSON),
+      message(nullptr),
+      messageLength(0),
+      messageCapacity(0),
+      messageOpcode(0),
+      messageDiscarded(false),
+      stale(false),
+      sent(0),
+      coalesced(0),
+      topics(0),
+      topicsHash(0) {
+  }
+
+  bool reserveMessage(size_t capacity) {
+    if (capacity > WEB_SOCKET_MAX_MESSAGE_SIZE) {
+      return false;
+    }
+    if (capacity > messageCapacity) {
+      uint8_t* resized = (uint8_t*)realloc(message, capacity + 1);
+      if (!resized) {
+        return false;
+      }
+      message = resized;
+      messageCapacity = capacity;
+    }
+    return true;
+  }
+
+  bool appendMessage(const uint8_t* data, size_t len) {
+    if (messageLength + len > messageCapacity) {
+      return false;
+    }
+    memcpy(message + messageLength, data, len);
+    messageLength += len;
+    message[messageLength] = '\0';
+    return true;
+  }
+
+  void releaseMessage() {
+    free(message);
+    message = nullptr;
+    messageLength = 0;
+    messageCapacity = 0;
+    messageDiscarded = false;
+  }
+
+  /**
+   * Reassembles messages split across TCP packets or WebSocket frames into the message buffer. The buffer is sized
+   * from each frame header as the frame begins and is capped at WEB_SOCKET_MAX_MESSAGE_SIZE, larger messages are
+   * discarded. Returns true once a complete message is held, which the caller should release after processing.
+   */
+  bool receiveFragment(AwsFrameInfo* info, const uint8_t* data, size_t len) {
+    if (info->num == 0 && info->index == 0) {
+      releaseMessage();
+      messageOpcode = info->message_opcode;
+    }
+    if (!messageDiscarded) {
+      bool accepted = info->index > 0 || reserveMessage(messageLength + info->len);
+      if (!accepted || !appendMessage(data, len)) {
+        releaseMessage();
+        messageDiscarded = true;
+      }
+    }
+    return info->final && info->index + len == info->len && !messageDiscarded;
+  }
+};
+
 template <class T>
 class WebSocketConnector {
  protected:
@@ -17,6 +144,8 @@ class WebSocketConnector {
   AsyncWebServer* _server;
   AsyncWebSocket _webSocket;
   size_t _bufferSize;
+  const char* const* _topics = nullptr;
+  size_t _topicCount = 0;
 
   WebSocketConnector(StatefulService<T>* statefulService,
                      AsyncWebServer* server,
@@ -25,8 +154,11 @@ class WebSocketConnector {
                      AuthenticationPredicate authenticationPredicate,
                      size_t bufferSize) :
       _statefulService(statefulService), _server(server), _webSocket(webSocketPath), _bufferSize(bufferSize) {
+#ifdef ESP32
+    _accessMutex = xSemaphoreCreateRecursiveMutex();
+#endif
     _webSocket.setFilter(securityManager->filterRequest(authenticationPredicate));
-    _webSocket.onEvent(std::bind(&WebSocketConnector::onWSEvent,
+    _webSocket.onEvent(std::bind(&WebSocketConnector::handleWSEvent,
                                  this,
                                  std::placeholders::_1,
                                  std::placeholders::_2,
@@ -43,7 +175,10 @@ class WebSocketConnector {
                      const char* webSocketPath,
                      size_t bufferSize) :
       _statefulService(statefulService), _server(server), _webSocket(webSocketPath), _bufferSize(bufferSize) {
-    _webSocket.onEvent(std::bind(&WebSocketConnector::onWSEvent,
+#ifdef ESP32
+    _accessMutex = xSemaphoreCreateRecursiveMutex();
+#endif
+    _webSocket.onEvent(std::bind(&WebSocketConnector::handleWSEvent,
                                  this,
                                  std::placeholders::_1,
                                  std::placeholders::_2,
@@ -65,10 +200,158 @@ class WebSocketConnector {
     return WEB_SOCKET_ORIGIN_CLIENT_ID_PREFIX + String(client->id());
   }
 
+  /**
+   * Maps an origin id of the form "websocket:<id>" back to the client id, returns 0 for any other origin.
+   */
+  uint32_t originClientId(const String& originId) {
+    static const size_t prefixLength = strlen(WEB_SOCKET_ORIGIN_CLIENT_ID_PREFIX);
+    if (!originId.startsWith(WEB_SOCKET_ORIGIN_CLIENT_ID_PREFIX)) {
+      return 0;
+    }
+    return strtoul(originId.c_str() + prefixLength, nullptr, 10);
+  }
+
+  WebSocketClientSession* session(AsyncWebSocketClient* client) {
+    for (WebSocketClientSession& session : _sessions) {
+      if (session.clientId == client->id()) {
+        return &session;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Returns true if the key is one of the topics in the mask, a mask of 0 subscribes to every key.
+   */
+  bool subscribed(uint32_t topics, const char* key) {
+    if (!topics) {
+      return true;
+    }
+    for (size_t i = 0; i < _topicCount; i++) {
+      if ((topics & ((uint32_t)1 << i)) && strcmp(_topics[i], key) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  WebSocketFormat format(AsyncWebSocketClient* client) {
+    WebSocketClientSession* clientSession = session(client);
+    return clientSession ? clientSession->format : WebSocketFormat::JSON;
+  }
+
+  /**
+   * Calls the function provided for each connected client with a session, holding the lock.
+   */
+  template <typename F>
+  void forEachClient(F fn) {
+    lock();
+    for (WebSocketClientSession& session : _sessions) {
+      if (session.clientId) {
+        AsyncWebSocketClient* client = _webSocket.client(session.clientId);
+        if (client && client->status() == WS_CONNECTED) {
+          fn(client, session);
+        }
+      }
+    }
+    unlock();
+  }
+
+  /**
+   * Serializes access to the sessions, the clients and the transmission state between the main loop and the async web
+   * server. A client is not removed by the library until its disconnect event, which takes the lock, has returned.
+   */
+  inline void lock() {
+#ifdef ESP32
+    xSemaphoreTakeRecursive(_accessMutex, portMAX_DELAY);
+#endif
+  }
+
+  inline void unlock() {
+#ifdef ESP32
+    xSemaphoreGiveRecursive(_accessMutex);
+#endif
+  }
+
  private:
+#ifdef ESP32
+  SemaphoreHandle_t _accessMutex;
+#endif
+  WebSocketClientSession _sessions[WEB_SOCKET_MAX_CLIENTS];
+
   void forbidden(AsyncWebServerRequest* request) {
     request->send(403);
   }
+
+  /**
+   * Maintains the session table around the event dispatch. Clients which can not be given a session are closed, the
+   * table bounds the memory used per WebSocket.
+   */
+  void handleWSEvent(AsyncWebSocket* server,
+                     AsyncWebSocketClient* client,
+                     AwsEventType type,
+                     void* arg,
+                     uint8_t* data,
+                     size_t len) {
+    lock();
+    if (type == WS_EVT_CONNECT && !openSession(client, (AsyncWebServerRequest*)arg)) {
+      unlock();
+      client->close();
+      return;
+    }
+    if (type == WS_EVT_DISCONNECT && !session(client)) {
+      unlock();
+      return;
+    }
+    onWSEvent(server, client, type, arg, data, len);
+    if (type == WS_EVT_DISCONNECT) {
+      WebSocketClientSession* clientSession = session(client);
+      clientSession->releaseMessage();
+      *clientSession = WebSocketClientSession();
+    }
+    unlock();
+  }
+
+  bool openSession(AsyncWebSocketClient* client, AsyncWebServerRequest* request) {
+    for (WebSocketClientSession& session : _sessions) {
+      if (!session.clientId) {
+        session = WebSocketClientSession();
+        session.clientId = client->id();
+        if (request && request->hasParam(WEB_SOCKET_FORMAT_PARAM) &&
+            request->getParam(WEB_SOCKET_FORMAT_PARAM)->value() == WEB_SOCKET_FORMAT_MSGPACK) {
+          session.format = WebSocketFormat::MSGPACK;
+        }
+        if (request && request->hasParam(WEB_SOCKET_TOPICS_PARAM)) {
+          session.topics = parseTopics(request->getParam(WEB_SOCKET_TOPICS_PARAM)->value());
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Maps a comma separated list of topic names to a bitmask, unknown names are ignored.
+   */
+  uint32_t parseTopics(const String& topicList) {
+    uint32_t topics = 0;
+    int start = 0;
+    while (start <= (int)topicList.length()) {
+      int end = topicList.indexOf(',', start);
+      if (end < 0) {
+        end = topicList.length();
+      }
+      String topic = topicList.substring(start, end);
+      topic.trim();
+      for (size_t i = 0; i < _topicCount; i++) {
+        if (topic == _topics[i]) {
+          topics |= (uint32_t)1 << i;
+        }
+      }
+      start = end + 1;
+    }
+    return topics;
+  }
 };
 
 template <class T>
@@ -87,9 +370,17 @@ class WebSocketTx : virtual public WebSocketConnector<T> {
                             securityManager,
                             authenticationPredicate,
                             bufferSize),
-      _stateReader(stateReader) {
-    WebSocketConnector<T>::_statefulService->addUpdateHandler(
-        [&](const String& originId) { transmitData(nullptr, originId); }, false);
+      _stateReader(stateReader),
+      _broadcastInterval(WEB_SOCKET_BROADCAST_INTERVAL),
+      _lastBroadcast(0),
+      _broadcastPending(false),
+      _pendingMixedOrigins(false) {
+    if (!WebSocketConnector<T>::_statefulService->addUpdateHandler(
+            [&](const String& originId) { onUpdate(originId); }, false)) {
+      Serial.println(F("WebSocketTx will not transmit changes"));
+    }
+    // allocate the shared pool now, before the heap has had a chance to fragment
+    WebSocketBufferPool::instance();
   }
 
   WebSocketTx(JsonStateReader<T> stateReader,
@@ -97,9 +388,72 @@ class WebSocketTx : virtual public WebSocketConnector<T> {
               AsyncWebServer* server,
               const char* webSocketPath,
               size_t bufferSize = DEFAULT_BUFFER_SIZE) :
-      WebSocketConnector<T>(statefulService, server, webSocketPath, bufferSize), _stateReader(stateReader) {
-    WebSocketConnector<T>::_statefulService->addUpdateHandler(
-        [&](const String& originId) { transmitData(nullptr, originId); }, false);
+      WebSocketConnector<T>(statefulService, server, webSocketPath, bufferSize),
+      _stateReader(stateReader),
+      _broadcastInterval(WEB_SOCKET_BROADCAST_INTERVAL),
+      _lastBroadcast(0),
+      _broadcastPending(false),
+      _pendingMixedOrigins(false) {
+    if (!WebSocketConnector<T>::_statefulService->addUpdateHandler(
+            [&](const String& originId) { onUpdate(originId); }, false)) {
+      Serial.println(F("WebSocketTx will not transmit changes"));
+    }
+    // allocate the shared pool now, before the heap has had a chance to fragment
+    WebSocketBufferPool::instance();
+  }
+
+  /**
+   * Declares the topics clients may subscribe to, each naming a top level key of the state's JSON. Topics are selected
+   * when connecting, e.g. "?topics=color,pins", and clients which select none receive the whole state. The array must
+   * outlive the WebSocket. Topic names are written to clients as they are, so must not need escaping in JSON and must
+   * be shorter than 256 characters.
+   */
+  void setTopics(const char* const* topics, size_t topicCount) {
+    WebSocketConnector<T>::_topics = topics;
+    WebSocketConnector<T>::_topicCount = topicCount < WEB_SOCKET_MAX_TOPICS ? topicCount : WEB_SOCKET_MAX_TOPICS;
+  }
+
+  /**
+   * Limits broadcasts to one per interval (ms). Updates arriving within the interval are collapsed into a single
+   * trailing broadcast of the latest state, sent from loop(). An interval of 0 broadcasts every update.
+   */
+  void setBroadcastInterval(uint32_t broadcastInterval) {
+    _broadcastInterval = broadcastInterval;
+  }
+
+  /**
+   * Sends any trailing broadcast which is due and the latest payload to clients which missed updates while their
+   * queue was full. Call from the main loop.
+   */
+  void loop() {
+    WebSocketConnector<T>::lock();
+    if (_broadcastPending && (uint32_t)(millis() - _lastBroadcast) >= _broadcastInterval) {
+      broadcast(_pendingOriginId, !_pendingMixedOrigins);
+    }
+    WebSocketConnector<T>::forEachClient([&](AsyncWebSocketClient* client, WebSocketClientSession& session) {
+      if (session.stale && !client->queueIsFull()) {
+        transmitData(client, _lastOriginId);
+      }
+    });
+    WebSocketConnector<T>::unlock();
+  }
+
+  /**
+   * Reports the backpressure state of each connected client.
+   */
+  void readClientStatus(JsonObject& root) {
+    JsonArray clients = root.createNestedArray("clients");
+    WebSocketConnector<T>::forEachClient([&](AsyncWebSocketClient* client, WebSocketClientSession& session) {
+      JsonObject clientStatus = clients.createNestedObject();
+      clientStatus["id"] = WebSocketConnector<T>::clientId(client);
+      clientStatus["format"] = session.format == WebSocketFormat::MSGPACK ? WEB_SOCKET_FORMAT_MSGPACK : "json";
+      clientStatus["queue_full"] = client->queueIsFull();
+      clientStatus["stale"] = session.stale;
+      clientStatus["sent"] = session.sent;
+      clientStatus["coalesced"] = session.coalesced;
+    });
+    JsonObject bufferPool = root.createNestedObject("buffer_pool");
+    WebSocketBufferPool::instance().readStatus(bufferPool);
   }
 
  protected:
@@ -117,46 +471,354 @@ class WebSocketTx : virtual public WebSocketConnector<T> {
   }
 
  private:
+  // the message buffers built for clients sharing a subscription
+  struct PayloadFrames {
+    uint32_t topics = 0;
+    uint32_t hash = 0;
+    WebSocketPoolBuffer* text = nullptr;
+    WebSocketPoolBuffer* binary = nullptr;
+  };
+
+  struct HashWriter {
+    uint32_t hash = 2166136261;
+
+    size_t write(uint8_t c) {
+      hash = (hash ^ c) * 16777619;
+      return 1;
+    }
+
+    size_t write(const uint8_t* s, size_t n) {
+      for (size_t i = 0; i < n; i++) {
+        write(s[i]);
+      }
+      return n;
+    }
+  };
+
+  struct LengthWriter {
+    size_t length = 0;
+
+    size_t write(uint8_t) {
+      length++;
+      return 1;
+    }
+
+    size_t write(const uint8_t*, size_t n) {
+      length += n;
+      return n;
+    }
+  };
+
+  struct BufferWriter {
+    uint8_t* data;
+    size_t length = 0;
+
+    BufferWriter(uint8_t* data) : data(data) {
+    }
+
+    size_t write(uint8_t c) {
+      data[length++] = c;
+      return 1;
+    }
+
+    size_t write(const uint8_t* s, size_t n) {
+      memcpy(data + length, s, n);
+      length += n;
+      return n;
+    }
+  };
+
   JsonStateReader<T> _stateReader;
+  String _lastOriginId;
+  uint32_t _broadcastInterval;
+  uint32_t _lastBroadcast;
+  bool _broadcastPending;
+  bool _pendingMixedOrigins;
+  String _pendingOriginId;
+
+  /**
+   * Called from whichever task updated the state, the pending broadcast is shared with loop() under the lock.
+   */
+  void onUpdate(const String& originId) {
+    WebSocketConnector<T>::lock();
+    if (_broadcastInterval && (uint32_t)(millis() - _lastBroadcast) < _broadcastInterval) {
+      // a collapsed broadcast carrying changes from several origins must reach all of them
+      _pendingMixedOrigins = _broadcastPending && (_pendingMixedOrigins || _pendingOriginId != originId);
+      _pendingOriginId = originId;
+      _broadcastPending = true;
+    } else {
+      broadcast(originId, true);
+    }
+    WebSocketConnector<T>::unlock();
+  }
+
+  void broadcast(const String& originId, bool excludeOrigin) {
+    _broadcastPending = false;
+    _lastBroadcast = millis();
+    transmitData(nullptr, originId, excludeOrigin);
+  }
 
   void transmitId(AsyncWebSocketClient* client) {
-    DynamicJsonDocument jsonDocument = DynamicJsonDocument(WEB_SOCKET_CLIENT_ID_MSG_SIZE);
+    StaticJsonDocument<WEB_SOCKET_CLIENT_ID_MSG_SIZE> jsonDocument;
     JsonObject root = jsonDocument.to<JsonObject>();
     root["type"] = "id";
     root["id"] = WebSocketConnector<T>::clientId(client);
-    size_t len = measureJson(jsonDocument);
-    AsyncWebSocketMessageBuffer* buffer = WebSocketConnector<T>::_webSocket.makeBuffer(len);
+    WebSocketPoolBuffer* buffer = nullptr;
+    if (WebSocketConnector<T>::format(client) == WebSocketFormat::MSGPACK) {
+      JsonVariant id = root["id"];
+      buffer = makeBinaryBuffer(WEB_SOCKET_BINARY_ID, id, JsonVariant());
+      if (buffer) {
+        WebSocketBufferPool::instance().binary(client, buffer);
+      }
+    } else {
+      buffer = makeTextBuffer(root);
+      if (buffer) {
+        WebSocketBufferPool::instance().text(client, buffer);
+      }
+    }
     if (buffer) {
-      serializeJson(jsonDocument, (char*)buffer->get(), len + 1);
-      client->text(buffer);
+      WebSocketBufferPool::instance().release(buffer);
     }
   }
 
   /**
-   * Broadcasts the payload to the destination, if provided. Otherwise broadcasts to all clients except the origin, if
-   * specified.
+   * Broadcasts the payload to the destination, if provided. Otherwise broadcasts to all clients, except the client the
+   * update originated from when excludeOrigin is set. That client already holds the state it sent.
+   *
+   * Clients subscribed to a subset of topics receive only those keys of the payload, and broadcasts are skipped for
+   * them entirely when none of their topics changed. The payload is serialized at most once per subscription and
+   * format, clients sharing both share the same message buffer.
+   *
+   * Nothing is queued for a client whose send queue is full. The client is marked stale instead and receives only the
+   * latest payload once its queue has room, so a slow client never holds more than one queue of outdated payloads.
    *
    * Original implementation sent clients their own IDs so they could ignore updates they initiated. This approach
    * simplifies the client and the server implementation but may not be sufficent for all use-cases.
    */
-  void transmitData(AsyncWebSocketClient* client, const String& originId) {
-    DynamicJsonDocument jsonDocument = DynamicJsonDocument(WebSocketConnector<T>::_bufferSize);
+  void transmitData(AsyncWebSocketClient* client, const String& originId, bool excludeOrigin = false) {
+    WebSocketConnector<T>::lock();
+    // the message wraps the state, whose origin id is copied into the document
+    size_t capacity = JSON_OBJECT_SIZE(3) + originId.length() + 1 +
+                      WebSocketConnector<T>::_statefulService->getJsonCapacity(WebSocketConnector<T>::_bufferSize);
+    DynamicJsonDocument jsonDocument = DynamicJsonDocument(capacity);
     JsonObject root = jsonDocument.to<JsonObject>();
     root["type"] = "payload";
     root["origin_id"] = originId;
     JsonObject payload = root.createNestedObject("payload");
     WebSocketConnector<T>::_statefulService->read(payload, _stateReader);
+    // a truncated state is not sent, the update which outgrew the capacity is followed by another transmission
+    if (jsonDocument.overflowed()) {
+      Serial.printf_P(PSTR("State for %s overflowed its JSON buffer and was not sent\r\n"),
+                      WebSocketConnector<T>::_webSocket.url());
+      WebSocketConnector<T>::unlock();
+      return;
+    }
 
-    size_t len = measureJson(jsonDocument);
-    AsyncWebSocketMessageBuffer* buffer = WebSocketConnector<T>::_webSocket.makeBuffer(len);
-    if (buffer) {
-      serializeJson(jsonDocument, (char*)buffer->get(), len + 1);
-      if (client) {
-        client->text(buffer);
+    PayloadFrames frames[WEB_SOCKET_MAX_CLIENTS];
+    size_t frameCount = 0;
+    bool broadcasting = !client;
+    auto send = [&](AsyncWebSocketClient* client, WebSocketClientSession& session) {
+      PayloadFrames* clientFrames = nullptr;
+      for (size_t i = 0; i < frameCount && !clientFrames; i++) {
+        if (frames[i].topics == session.topics) {
+          clientFrames = &frames[i];
+        }
+      }
+      if (!clientFrames) {
+        if (frameCount == WEB_SOCKET_MAX_CLIENTS) {
+          return;
+        }
+        clientFrames = &frames[frameCount++];
+        clientFrames->topics = session.topics;
+        clientFrames->hash = session.topics ? topicsHash(payload, session.topics) : 0;
+      }
+      if (session.topics && session.topicsHash == clientFrames->hash) {
+        // broadcasts are skipped when the subscribed topics are unchanged, direct transmissions are always sent
+        session.stale = false;
+        if (broadcasting) {
+          return;
+        }
+      }
+      if (client->queueIsFull()) {
+        session.stale = true;
+        session.coalesced++;
+        return;
+      }
+      session.stale = false;
+      session.sent++;
+      session.topicsHash = clientFrames->hash;
+      if (session.format == WebSocketFormat::MSGPACK) {
+        if (!clientFrames->binary) {
+          clientFrames->binary = makePayloadBuffer(root, session.topics, WebSocketFormat::MSGPACK);
+        }
+        if (clientFrames->binary) {
+          WebSocketBufferPool::instance().binary(client, clientFrames->binary);
+        }
       } else {
-        WebSocketConnector<T>::_webSocket.textAll(buffer);
+        if (!clientFrames->text) {
+          clientFrames->text = makePayloadBuffer(root, session.topics, WebSocketFormat::JSON);
+        }
+        if (clientFrames->text) {
+          WebSocketBufferPool::instance().text(client, clientFrames->text);
+        }
+      }
+    };
+    if (client) {
+      WebSocketClientSession* session = WebSocketConnector<T>::session(client);
+      if (session) {
+        send(client, *session);
       }
+    } else {
+      _lastOriginId = originId;
+      uint32_t excludedId = excludeOrigin ? WebSocketConnector<T>::originClientId(originId) : 0;
+      WebSocketConnector<T>::forEachClient([&](AsyncWebSocketClient* client, WebSocketClientSession& session) {
+        if (client->id() != excludedId) {
+          send(client, session);
+        }
+      });
     }
+    for (size_t i = 0; i < frameCount; i++) {
+      if (frames[i].text) {
+        WebSocketBufferPool::instance().release(frames[i].text);
+      }
+      if (frames[i].binary) {
+        WebSocketBufferPool::instance().release(frames[i].binary);
+      }
+    }
+    WebSocketConnector<T>::unlock();
+  }
+
+  /**
+   * Serializes a payload message in the given format, keeping only the subscribed keys of the payload. A subset is
+   * measured and then written straight from the message holding the whole state, rather than copied into a document
+   * of its own.
+   */
+  WebSocketPoolBuffer* makePayloadBuffer(JsonObject& root, uint32_t topics, WebSocketFormat format) {
+    if (topics) {
+      LengthWriter length;
+      writeSubset(length, root, topics, format);
+      WebSocketPoolBuffer* buffer = WebSocketBufferPool::instance().makeBuffer(length.length);
+      if (buffer) {
+        BufferWriter writer(buffer->data);
+        writeSubset(writer, root, topics, format);
+        // the pool's buffers hold an extra byte for the null terminator of text frames
+        writer.data[writer.length] = 0;
+      }
+      return buffer;
+    }
+    if (format == WebSocketFormat::MSGPACK) {
+      JsonVariant origin = root["origin_id"];
+      JsonVariant payload = root["payload"];
+      return makeBinaryBuffer(WEB_SOCKET_BINARY_PAYLOAD, origin, payload);
+    }
+    return makeTextBuffer(root);
+  }
+
+  /**
+   * Writes the payload message with only the subscribed keys of the payload, the same message makePayloadBuffer()
+   * serializes for the whole state.
+   */
+  template <typename Writer>
+  void writeSubset(Writer& writer, JsonObject& root, uint32_t topics, WebSocketFormat format) {
+    JsonObject payload = root["payload"];
+    if (format == WebSocketFormat::MSGPACK) {
+      writer.write((uint8_t)WEB_SOCKET_BINARY_PAYLOAD);
+      serializeMsgPack(root["origin_id"], writer);
+      size_t keys = 0;
+      for (JsonPair kv : payload) {
+        if (WebSocketConnector<T>::subscribed(topics, kv.key().c_str())) {
+          keys++;
+        }
+      }
+      // a fixmap holds up to 15 keys, a map16 all WEB_SOCKET_MAX_TOPICS
+      if (keys < 16) {
+        writer.write((uint8_t)(0x80 | keys));
+      } else {
+        writer.write((uint8_t)0xde);
+        writer.write((uint8_t)(keys >> 8));
+        writer.write((uint8_t)keys);
+      }
+    } else {
+      writeText(writer, "{\"type\":");
+      serializeJson(root["type"], writer);
+      writeText(writer, ",\"origin_id\":");
+      serializeJson(root["origin_id"], writer);
+      writeText(writer, ",\"payload\":{");
+    }
+    bool first = true;
+    for (JsonPair kv : payload) {
+      const char* key = kv.key().c_str();
+      if (!WebSocketConnector<T>::subscribed(topics, key)) {
+        continue;
+      }
+      size_t keyLength = strlen(key);
+      if (format == WebSocketFormat::MSGPACK) {
+        // a fixstr holds up to 31 bytes, a str8 up to 255
+        if (keyLength < 32) {
+          writer.write((uint8_t)(0xa0 | keyLength));
+        } else {
+          writer.write((uint8_t)0xd9);
+          writer.write((uint8_t)keyLength);
+        }
+        writer.write((const uint8_t*)key, keyLength);
+        serializeMsgPack(kv.value(), writer);
+      } else {
+        writeText(writer, first ? "\"" : ",\"");
+        writeText(writer, key);
+        writeText(writer, "\":");
+        serializeJson(kv.value(), writer);
+      }
+      first = false;
+    }
+    if (format == WebSocketFormat::JSON) {
+      writeText(writer, "}}");
+    }
+  }
+
+  template <typename Writer>
+  static void writeText(Writer& writer, const char* text) {
+    writer.write((const uint8_t*)text, strlen(text));
+  }
+
+  /**
+   * FNV-1a hash of the subscribed parts of the payload, in their MessagePack encoding.
+   */
+  uint32_t topicsHash(JsonObject& payload, uint32_t topics) {
+    HashWriter writer;
+    for (JsonPair kv : payload) {
+      if (WebSocketConnector<T>::subscribed(topics, kv.key().c_str())) {
+        writer.write((const uint8_t*)kv.key().c_str(), strlen(kv.key().c_str()));
+        serializeMsgPack(kv.value(), writer);
+      }
+    }
+    return writer.hash;
+  }
+
+  WebSocketPoolBuffer* makeTextBuffer(JsonObject root) {
+    return WebSocketBufferPool::instance().makeTextBuffer(root);
+  }
+
+  /**
+   * Builds a binary frame: the message type byte followed by the MessagePack encoding of each non-null value. The
+   * returned buffer is held and must be released once it has been queued.
+   */
+  WebSocketPoolBuffer* makeBinaryBuffer(uint8_t messageType, JsonVariant first, JsonVariant second) {
+    size_t firstLen = first.isNull() ? 0 : measureMsgPack(first);
+    size_t secondLen = second.isNull() ? 0 : measureMsgPack(second);
+    size_t len = 1 + firstLen + secondLen;
+    WebSocketPoolBuffer* buffer = WebSocketBufferPool::instance().makeBuffer(len);
+    if (buffer) {
+      // the pool's buffers hold an extra byte, as they do for the null terminator of text frames
+      uint8_t* data = buffer->data;
+      data[0] = messageType;
+      if (firstLen) {
+        serializeMsgPack(first, data + 1, len);
+      }
+      if (secondLen) {
+        serializeMsgPack(second, data + 1 + firstLen, secondLen + 1);
+      }
+    }
+    return buffer;
   }
 };
 
@@ -196,22 +858,39 @@ class WebSocketRx : virtual public WebSocketConnector<T> {
                          size_t len) {
     if (type == WS_EVT_DATA) {
       AwsFrameInfo* info = (AwsFrameInfo*)arg;
-      if (info->final && info->index == 0 && info->len == len) {
-        if (info->opcode == WS_TEXT) {
-          DynamicJsonDocument jsonDocument = DynamicJsonDocument(WebSocketConnector<T>::_bufferSize);
-          DeserializationError error = deserializeJson(jsonDocument, (char*)data);
-          if (!error && jsonDocument.is<JsonObject>()) {
-            JsonObject jsonObject = jsonDocument.as<JsonObject>();
-            WebSocketConnector<T>::_statefulService->update(
-                jsonObject, _stateUpdater, WebSocketConnector<T>::clientId(client));
-          }
-        }
+      if (info->final && info->index == 0 && info->len == len && info->num == 0) {
+        // the whole message arrived in one piece, parse it in place
+        updateState(client, info->opcode, data, len);
+      } else {
+        receiveFragment(client, info, data, len);
       }
     }
   }
 
  private:
   JsonStateUpdater<T> _stateUpdater;
+
+  void updateState(AsyncWebSocketClient* client, uint8_t opcode, uint8_t* data, size_t len) {
+    if (opcode != WS_TEXT && opcode != WS_BINARY) {
+      return;
+    }
+    DynamicJsonDocument jsonDocument = DynamicJsonDocument(WebSocketConnector<T>::_bufferSize);
+    DeserializationError error =
+        opcode == WS_TEXT ? deserializeJson(jsonDocument, (char*)data, len) : deserializeMsgPack(jsonDocument, data, len);
+    if (!error && jsonDocument.is<JsonObject>()) {
+      JsonObject jsonObject = jsonDocument.as<JsonObject>();
+      WebSocketConnector<T>::_statefulService->update(
+          jsonObject, _stateUpdater, WebSocketConnector<T>::clientId(client));
+    }
+  }
+
+  void receiveFragment(AsyncWebSocketClient* client, AwsFrameInfo* info, uint8_t* data, size_t len) {
+    WebSocketClientSession* session = WebSocketConnector<T>::session(client);
+    if (session && session->receiveFragment(info, data, len)) {
+      updateState(client, session->messageOpcode, session->message, session->messageLength);
+      session->releaseMessage();
+    }
+  }
 };
 
 template <class T>
@@ -50,6 +50,12 @@ void WiFiStatus::onStationModeGotIP(const WiFiEventStationModeGotIP& event) {
 void WiFiStatus::wifiStatus(AsyncWebServerRequest* request) {
   AsyncJsonResponse* response = new AsyncJsonResponse(false, MAX_WIFI_STATUS_SIZE);
   JsonObject root = response->getRoot();
+  readStatus(root);
+  response->setLength();
+  request->send(response);
+}
+
+void WiFiStatus::readStatus(JsonObject& root) {
   wl_status_t status = WiFi.status();
   root["status"] = (uint8_t)status;
   if (status == WL_CONNECTED) {
@@ -70,6 +76,4 @@ void WiFiStatus::wifiStatus(AsyncWebServerRequest* request) {
       root["dns_ip_2"] = dnsIP2.toString();
     }
   }
-  response->setLength();
-  request->send(response);
 }
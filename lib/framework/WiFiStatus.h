@@ -22,6 +22,8 @@ class WiFiStatus {
  public:
   WiFiStatus(AsyncWebServer* server, SecurityManager* securityManager);
 
+  void readStatus(JsonObject& root);
+
  private:
 #ifdef ESP32
   // static functions for logging WiFi events to the UART
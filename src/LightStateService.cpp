@@ -30,6 +30,9 @@ LightStateService::LightStateService(AsyncWebServer* server,
   // configure update handler for when the light settings change
   _lightMqttSettingsService->addUpdateHandler([&](const String& originId) { registerConfig(); }, false);
 
+  // the state has a fixed shape, its documents need no more than this
+  setJsonCapacityHint([](LightState& settings) { return LightState::JSON_CAPACITY; });
+
   // configure settings service update handler to update LED state
   addUpdateHandler([&](const String& originId) { onConfigUpdated(); }, false);
 }
@@ -30,6 +30,9 @@ class LightState {
  public:
   bool ledOn;
 
+  // both read() and haRead() write a single member, haRead()'s value is a string literal which is not copied
+  static constexpr size_t JSON_CAPACITY = JSON_OBJECT_SIZE(1);
+
   static void read(LightState& settings, JsonObject& root) {
     root["led_on"] = settings.ledOn;
   }
@@ -1,7 +1,16 @@
 #include <RGBLightStateService.h>
+#include <ScheduleCalendarService.h>
+#include <cstddef>
 #include <ctime>
 
-RGBLightStateService::RGBLightStateService(AsyncWebServer* server, SecurityManager* securityManager, FS* fs) :
+// top level keys of the state which WebSocket clients may subscribe to individually
+static const char* const RGB_LIGHT_SOCKET_TOPICS[] = {"color", "pins", "schedules"};
+
+RGBLightStateService::RGBLightStateService(AsyncWebServer* server,
+                                           SecurityManager* securityManager,
+                                           FS* fs,
+                                           WebSocketHub* webSocketHub,
+                                           ScheduleCalendarService* scheduleCalendarService) :
     _httpEndpoint(RGBLightState::read,
                   RGBLightState::update,
                   this,
@@ -16,29 +25,135 @@ RGBLightStateService::RGBLightStateService(AsyncWebServer* server, SecurityManag
                RGB_LIGHT_SETTINGS_SOCKET_PATH,
                securityManager,
                AuthenticationPredicates::IS_AUTHENTICATED),
-    _fsPersistence(RGBLightState::read, RGBLightState::update, this, fs, RGB_LIGHT_SETTINGS_FILE) {
-  RGBLightStateService::updateRGBLedState();
+    _fsPersistence(RGBLightState::read, RGBLightState::update, this, fs, RGB_LIGHT_SETTINGS_FILE),
+    _history(RGBLightState::encode, this),
+    _historyEndpoint(&_history,
+                     RGBLightState::readSnapshot,
+                     server,
+                     RGB_LIGHT_HISTORY_ENDPOINT_PATH,
+                     securityManager,
+                     AuthenticationPredicates::IS_AUTHENTICATED),
+    _schedulesEndpoint(RGBLightState::readSchedule,
+                       []() { return new RGBLightStateBuilder(); },
+                       this,
+                       server,
+                       RGB_LIGHT_SCHEDULES_ENDPOINT_PATH,
+                       securityManager,
+                       AuthenticationPredicates::IS_AUTHENTICATED),
+    _scheduleCalendarService(scheduleCalendarService),
+    _timelineVersion(0) {
+  server->on(RGB_LIGHT_SOCKET_STATUS_PATH,
+             HTTP_GET,
+             securityManager->wrapRequest(std::bind(&RGBLightStateService::socketStatus, this, std::placeholders::_1),
+                                          AuthenticationPredicates::IS_AUTHENTICATED));
+  _httpEndpoint.setStateStreamer(
+      JsonStateStreamer<RGBLightState>(RGBLightState::readHead, "schedules", RGBLightState::readSchedule));
+  _httpEndpoint.setStateBuilder("schedules", []() { return new RGBLightStateBuilder(); });
+  setJsonCapacityHint(RGBLightState::jsonCapacity);
+  _fsPersistence.setWriteDelay(RGB_LIGHT_WRITE_QUIET_PERIOD, RGB_LIGHT_WRITE_MAX_DELAY);
+  _fsPersistence.setBinaryFormat(RGB_LIGHT_SETTINGS_BINARY_FILE,
+                                 RGB_LIGHT_SETTINGS_SCHEMA_VERSION,
+                                 RGBLightState::writeBinary,
+                                 RGBLightState::readBinary);
+  _webSocket.setBroadcastInterval(RGB_LIGHT_BROADCAST_INTERVAL);
+  _webSocket.setTopics(RGB_LIGHT_SOCKET_TOPICS, sizeof(RGB_LIGHT_SOCKET_TOPICS) / sizeof(RGB_LIGHT_SOCKET_TOPICS[0]));
+  webSocketHub->addChannel("rgbLight",
+                           this,
+                           RGBLightState::read,
+                           RGBLightState::update,
+                           AuthenticationPredicates::IS_AUTHENTICATED);
+  webSocketHub->addStatusChannel("rgbLightSocketStatus",
+                                 [this](JsonObject& root) { _webSocket.readClientStatus(root); });
+  // resume the output of the previous run before networking, the settings and the schedules are up
+  restoreRuntime();
   addUpdateHandler([&](const String& originId) { onConfigUpdated(originId); }, false);
 }
 
+void RGBLightStateService::socketStatus(AsyncWebServerRequest* request) {
+  AsyncJsonResponse* response = new AsyncJsonResponse(false, MAX_RGB_LIGHT_SOCKET_STATUS_SIZE);
+  JsonObject root = response->getRoot();
+  _webSocket.readClientStatus(root);
+  response->setLength();
+  request->send(response);
+}
+
 void RGBLightStateService::updateRGBLedState() {
-  if(currentColor == _state.color) {
+  writeOutput(_state.color, 0);
+}
+
+void RGBLightStateService::temporarilyUpdateRGBLedState(const RGBColor& newColor, int64_t nextTransition) {
+  writeOutput(newColor, nextTransition);
+}
+
+void RGBLightStateService::writeOutput(const RGBColor& color, int64_t nextTransition) {
+  if (currentColor == color && currentTransition == nextTransition) {
     return;
   }
-  analogWrite(_state.pins.rPin, _state.color.r);
-  analogWrite(_state.pins.gPin, _state.color.g);
-  analogWrite(_state.pins.bPin, _state.color.b);
-  currentColor = _state.color;
+  if (currentColor != color) {
+    analogWrite(_state.pins.rPin, color.r);
+    analogWrite(_state.pins.gPin, color.g);
+    analogWrite(_state.pins.bPin, color.b);
+    currentColor = color;
+  }
+  currentTransition = nextTransition;
+  saveRuntime();
 }
 
-void RGBLightStateService::temporarilyUpdateRGBLedState(const RGBColor& newColor) {
-  if(currentColor == newColor) {
-    return;
+#ifdef ESP32
+RTC_NOINIT_ATTR static RGBLightRuntime rtcRuntime;
+#endif
+
+static uint32_t runtimeChecksum(const RGBLightRuntime& runtime) {
+  return FSPersistenceBase::crc32(0, (const uint8_t*)&runtime, offsetof(RGBLightRuntime, checksum));
+}
+
+/**
+ * Drives the output saved by the previous run unless the clock, if set, shows it was due to change since.
+ */
+bool RGBLightStateService::restoreRuntime() {
+  RGBLightRuntime runtime;
+#ifdef ESP32
+  runtime = rtcRuntime;
+#elif defined(ESP8266)
+  if (!ESP.rtcUserMemoryRead(RGB_LIGHT_RUNTIME_RTC_OFFSET, (uint32_t*)&runtime, sizeof(runtime))) {
+    return false;
+  }
+#else
+  return false;
+#endif
+  if (runtime.magic != RGB_LIGHT_RUNTIME_MAGIC || runtime.checksum != runtimeChecksum(runtime)) {
+    return false;
   }
-  analogWrite(_state.pins.rPin, newColor.r);
-  analogWrite(_state.pins.gPin, newColor.g);
-  analogWrite(_state.pins.bPin, newColor.b);
-  currentColor = newColor;
+  int64_t now = std::chrono::duration_cast<Seconds>(Clock::now().time_since_epoch()).count();
+  if (now >= RGB_LIGHT_CLOCK_SET_AFTER && runtime.nextTransition && now >= runtime.nextTransition) {
+    return false;
+  }
+  analogWrite(runtime.pins[0], runtime.color[0]);
+  analogWrite(runtime.pins[1], runtime.color[1]);
+  analogWrite(runtime.pins[2], runtime.color[2]);
+  currentColor = RGBColor(runtime.color[0], runtime.color[1], runtime.color[2]);
+  currentTransition = runtime.nextTransition;
+  runtimeRestored = true;
+  return true;
+}
+
+void RGBLightStateService::saveRuntime() {
+  RGBLightRuntime runtime;
+  memset(&runtime, 0, sizeof(runtime));
+  runtime.magic = RGB_LIGHT_RUNTIME_MAGIC;
+  runtime.pins[0] = _state.pins.rPin;
+  runtime.pins[1] = _state.pins.gPin;
+  runtime.pins[2] = _state.pins.bPin;
+  runtime.color[0] = constrain(currentColor.r, 0, 255);
+  runtime.color[1] = constrain(currentColor.g, 0, 255);
+  runtime.color[2] = constrain(currentColor.b, 0, 255);
+  runtime.nextTransition = currentTransition;
+  runtime.checksum = runtimeChecksum(runtime);
+#ifdef ESP32
+  rtcRuntime = runtime;
+#elif defined(ESP8266)
+  ESP.rtcUserMemoryWrite(RGB_LIGHT_RUNTIME_RTC_OFFSET, (uint32_t*)&runtime, sizeof(runtime));
+#endif
 }
 
 void RGBLightStateService::onConfigUpdated(const String& originId) {
@@ -49,73 +164,67 @@ void RGBLightStateService::onConfigUpdated(const String& originId) {
 
 void RGBLightStateService::begin() {
   _fsPersistence.readFromFS();
-  RGBLightStateService::updateRGBLedState();
-}
-
-std::string getDayOfWeek(const TimePoint& timePoint) {
-  auto timeT = Clock::to_time_t(timePoint);
-  std::tm* ptm = std::localtime(&timeT);
-  switch (ptm->tm_wday) {
-    case 0:
-      return "Sunday";
-    case 1:
-      return "Monday";
-    case 2:
-      return "Tuesday";
-    case 3:
-      return "Wednesday";
-    case 4:
-      return "Thursday";
-    case 5:
-      return "Friday";
-    case 6:
-      return "Saturday";
-    default:
-      return "";
+  _history.captureBaseline();
+  // a restored output is left to the schedules, so a scheduled color does not flicker back to the settings' color
+  if (!runtimeRestored) {
+    RGBLightStateService::updateRGBLedState();
   }
 }
 
-bool isTimeWithin24HourWindow(const TimePoint& currentTime, const TimePoint& startTime, const TimePoint& endTime) {
-  using namespace std::chrono;
-  auto currentSeconds = duration_cast<Seconds>(currentTime.time_since_epoch() % Seconds(86400));
-  auto startSeconds = duration_cast<Seconds>(startTime.time_since_epoch() % Seconds(86400));
-  auto endSeconds = duration_cast<Seconds>(endTime.time_since_epoch() % Seconds(86400));
-  return currentSeconds >= startSeconds && currentSeconds <= endSeconds;
+bool RGBLightStateService::activeColor(TimePoint now, RGBColor& color, int64_t& nextTransition) {
+  bool active = false;
+  read([&](RGBLightState& state) {
+    // the version is bumped while the lock is held, so it matches the schedules read under it
+    uint32_t version = getVersion();
+    if (version != _timelineVersion || !_timeline.covers(now)) {
+      _timeline.build(state.schedules, now);
+      _timelineVersion = version;
+    }
+    active = _timeline.evaluate(now, color);
+    nextTransition = _timeline.nextTransition();
+  });
+  return active;
 }
 
 void RGBLightStateService::loop() {
   using namespace std::chrono;
 
+  _webSocket.loop();
+
   TimePoint currentTime = Clock::now();
-  std::string currentDay = getDayOfWeek(currentTime);
 
   if (currentTime < lastCheckTime) {
     lastCheckTime = currentTime;
   }
 
-  if (_state.schedules.schedules.size() == 0 || duration_cast<Seconds>(currentTime - lastCheckTime).count() < 1) {
+  if (duration_cast<Seconds>(currentTime - lastCheckTime).count() < 1) {
     return;
   }
 
   lastCheckTime = currentTime;  // Update last check time
 
-  bool foundActiveSchedule = false;
-  for (const auto& schedule : _state.schedules.schedules) {
-    bool isTodayActive = schedule.isActiveOnDay(currentDay);
-
-    if (isTodayActive && isTimeWithin24HourWindow(currentTime, schedule.start, schedule.end)) {
-      temporarilyUpdateRGBLedState(schedule.color);
-      foundActiveSchedule = true;
-      break;
-    } else if (!isTodayActive && currentTime >= schedule.start && currentTime <= schedule.end) {
-      temporarilyUpdateRGBLedState(schedule.color);
-      foundActiveSchedule = true;
-      break;
+  // schedules can't be told apart before the clock is set, so a restored output is kept until it is
+  if (runtimeRestored) {
+    if (duration_cast<Seconds>(currentTime.time_since_epoch()).count() < RGB_LIGHT_CLOCK_SET_AFTER) {
+      return;
     }
+    runtimeRestored = false;
   }
 
-  if (!foundActiveSchedule) {
-    Serial.println("No active schedule found, reverting to default color");
-    updateRGBLedState();  // Use default color if set
+  // calendar entries take precedence over the light's own schedules, until the next calendar entry starts
+  RGBColor color;
+  int64_t calendarTransition = 0;
+  if (_scheduleCalendarService->activeColor(currentTime, color, calendarTransition)) {
+    temporarilyUpdateRGBLedState(color, calendarTransition);
+    return;
+  }
+  int64_t nextTransition = 0;
+  if (activeColor(currentTime, color, nextTransition)) {
+    if (calendarTransition && (!nextTransition || calendarTransition < nextTransition)) {
+      nextTransition = calendarTransition;
+    }
+    temporarilyUpdateRGBLedState(color, nextTransition);
+    return;
   }
+  updateRGBLedState();
 }
@@ -4,12 +4,11 @@
 #include <HttpEndpoint.h>
 #include <FSPersistence.h>
 #include <WebSocketTxRx.h>
+#include <StateHistory.h>
+#include <WebSocketHub.h>
+#include <NdjsonEndpoint.h>
+#include <ScheduleIndex.h>
 #include <type_traits>
-#include <chrono>
-
-using Clock = std::chrono::system_clock;
-using TimePoint = Clock::time_point;
-using Seconds = std::chrono::seconds;
 
 #define DEFAULT_RED_PIN 25
 #define DEFAULT_GREEN_PIN 26
@@ -22,6 +21,33 @@ using Seconds = std::chrono::seconds;
 #define RGB_LIGHT_SETTINGS_ENDPOINT_PATH "/rest/rgbLightState"
 #define RGB_LIGHT_SETTINGS_SOCKET_PATH "/ws/rgbLightState"
 #define RGB_LIGHT_SETTINGS_FILE "/config/rgbLightState.json"
+#define RGB_LIGHT_SETTINGS_BINARY_FILE "/config/rgbLightState.bin"
+#define RGB_LIGHT_HISTORY_ENDPOINT_PATH "/rest/rgbLightHistory"
+#define RGB_LIGHT_SCHEDULES_ENDPOINT_PATH "/rest/rgbLightSchedules"
+#define RGB_LIGHT_SOCKET_STATUS_PATH "/rest/rgbLightSocketStatus"
+
+#define MAX_RGB_LIGHT_SOCKET_STATUS_SIZE 1024
+
+// increment when the binary layout of the state changes, files of another version are ignored
+#define RGB_LIGHT_SETTINGS_SCHEMA_VERSION 1
+#define RGB_LIGHT_BINARY_HEAD_LENGTH 8
+
+// collapses color picker drags into at most one WebSocket broadcast per interval
+#define RGB_LIGHT_BROADCAST_INTERVAL 100
+
+// writes the state once it has been left alone for the quiet period, or at most the maximum delay after a change
+#define RGB_LIGHT_WRITE_QUIET_PERIOD 2000
+#define RGB_LIGHT_WRITE_MAX_DELAY 10000
+
+// the runtime snapshot's place in the ESP8266's RTC user memory, in 4 byte blocks
+#ifndef RGB_LIGHT_RUNTIME_RTC_OFFSET
+#define RGB_LIGHT_RUNTIME_RTC_OFFSET 64
+#endif
+
+#define RGB_LIGHT_RUNTIME_MAGIC 0x52474231
+
+// clocks reading earlier than this (2020-01-01) have not been set since power on
+#define RGB_LIGHT_CLOCK_SET_AFTER 1577836800
 
 struct RGBPins {
   int rPin, gPin, bPin;
@@ -43,153 +69,6 @@ struct RGBPins {
   }
 };
 
-struct RGBColor {
-  int r, g, b;
-
-  RGBColor(int red = 0, int green = 0, int blue = 0) : r(red), g(green), b(blue) {
-  }
-
-  bool operator==(const RGBColor& other) const {
-    return r == other.r && g == other.g && b == other.b;
-  }
-  bool operator!=(const RGBColor& other) const {
-    return !(*this == other);
-  }
-
-  bool isOff() const {
-    return r == 0 && g == 0 && b == 0;
-  }
-
-  void setOff() {
-    r = 0;
-    g = 0;
-    b = 0;
-  }
-
-  void setColor(int red, int green, int blue) {
-    r = red;
-    g = green;
-    b = blue;
-  }
-};
-
-struct Schedule {
-  TimePoint start;
-  TimePoint end;
-  RGBColor color;
-  std::vector<std::string> daysActive;
-
-  Schedule(TimePoint s = Clock::now(),
-           TimePoint e = Clock::now() + Seconds(60),
-           RGBColor c = RGBColor(0, 0, 0),
-           std::vector<std::string> days = {}) :
-      start(s), end(e), color(c), daysActive(days) {
-  }
-
-  bool isActiveOnDay(const std::string& day) const {
-    // If daysActive is empty, return false
-    if (daysActive.empty()) {
-      return false;
-    }
-    // If daysActive contains all seven days, return true
-    if (daysActive.size() == 7) {
-      return true;
-    }
-    // Else - search the list to see if the current day is active
-    return std::find(daysActive.begin(), daysActive.end(), day) != daysActive.end();
-  }
-
-  bool operator==(const Schedule& other) const {
-    if (start != other.start || end != other.end || color != other.color ||
-        daysActive.size() != other.daysActive.size()) {
-      return false;
-    }
-    auto sortedDays = daysActive;
-    auto sortedOtherDays = other.daysActive;
-    std::sort(sortedDays.begin(), sortedDays.end());
-    std::sort(sortedOtherDays.begin(), sortedOtherDays.end());
-    return sortedDays == sortedOtherDays;
-  }
-
-  bool operator!=(const Schedule& other) const {
-    return !(*this == other);
-  }
-  bool operator<(const Schedule& other) const {
-    return start < other.start;
-  }
-  bool operator>(const Schedule& other) const {
-    return start > other.start;
-  }
-  bool operator<=(const Schedule& other) const {
-    return start <= other.start;
-  }
-  bool operator>=(const Schedule& other) const {
-    return start >= other.start;
-  }
-};
-
-class Schedules {
- public:
-  std::vector<Schedule> schedules;
-
-  static void serializeToJsonAndRead(const Schedules& schedules, JsonArray& schedulesArray) {
-    for (const auto& schedule : schedules.schedules) {
-      JsonObject scheduleObj = schedulesArray.createNestedObject();
-      scheduleObj["start"] = std::chrono::duration_cast<Seconds>(schedule.start.time_since_epoch()).count();
-      scheduleObj["end"] = std::chrono::duration_cast<Seconds>(schedule.end.time_since_epoch()).count();
-      JsonArray daysArray = scheduleObj.createNestedArray("daysActive");
-      for (const auto& day : schedule.daysActive) {
-        daysArray.add(day);
-      }
-      JsonObject colorObj = scheduleObj.createNestedObject("color");
-      colorObj["r"] = schedule.color.r;
-      colorObj["g"] = schedule.color.g;
-      colorObj["b"] = schedule.color.b;
-    }
-  }
-
-  static StateUpdateResult deserializeJsonAndUpdate(const JsonArray& schedulesArray, Schedules& settings) {
-    std::vector<Schedule> newSchedules;
-
-    for (JsonObject scheduleObj : schedulesArray) {
-      if (!scheduleObj.containsKey("start") || !scheduleObj.containsKey("end") ||
-          !scheduleObj["color"].is<JsonObject>()) {
-        Serial.println("Missing schedule information");
-        continue;  // Skip malformed entries
-      }
-
-      auto start_seconds = Seconds(scheduleObj["start"].as<long long>());
-      auto end_seconds = Seconds(scheduleObj["end"].as<long long>());
-      TimePoint start = TimePoint(start_seconds);
-      TimePoint end = TimePoint(end_seconds);
-
-      JsonObject colorObj = scheduleObj["color"];
-      int r = colorObj["r"].as<int>();
-      int g = colorObj["g"].as<int>();
-      int b = colorObj["b"].as<int>();
-
-      JsonArray daysJsonArray = scheduleObj["daysActive"];
-      std::vector<std::string> days;
-      for (auto day : daysJsonArray) {
-        days.push_back(day.as<std::string>());
-      }
-      newSchedules.push_back(Schedule(start, end, RGBColor(r, g, b), days));
-    }
-
-    // Compare new schedules with existing ones to determine if there's a change
-    if (settings.schedules != newSchedules) {
-      settings.schedules.swap(newSchedules);
-      return StateUpdateResult::CHANGED;
-    }
-
-    return StateUpdateResult::UNCHANGED;
-  }
-
-  const std::vector<Schedule>& getSchedules() const {
-    return schedules;
-  }
-};
-
 class RGBLightState {
  public:
   RGBPins pins;
@@ -200,6 +79,25 @@ class RGBLightState {
   }
 
   static void read(RGBLightState& settings, JsonObject& root) {
+    readHead(settings, root);
+
+    // Reading schedules
+    JsonArray jsonSchedulesArray = root.createNestedArray("schedules");
+    Schedules::serializeToJsonAndRead(settings.schedules, jsonSchedulesArray);
+  }
+
+  // the capacity read() needs for the state
+  static size_t jsonCapacity(RGBLightState& settings) {
+    size_t capacity = JSON_OBJECT_SIZE(3) + 2 * JSON_OBJECT_SIZE(3) +
+                      JSON_ARRAY_SIZE(settings.schedules.schedules.size());
+    for (const auto& schedule : settings.schedules.schedules) {
+      capacity += Schedules::jsonCapacity(schedule);
+    }
+    return capacity;
+  }
+
+  // everything but the schedules, which the HTTP endpoint streams one at a time
+  static void readHead(RGBLightState& settings, JsonObject& root) {
     JsonObject pinsJson = root.createNestedObject("pins");
     pinsJson["rPin"] = settings.pins.rPin;
     pinsJson["gPin"] = settings.pins.gPin;
@@ -209,10 +107,14 @@ class RGBLightState {
     colorJson["r"] = settings.color.r;
     colorJson["g"] = settings.color.g;
     colorJson["b"] = settings.color.b;
+  }
 
-    // Reading schedules
-    JsonArray jsonSchedulesArray = root.createNestedArray("schedules");
-    Schedules::serializeToJsonAndRead(settings.schedules, jsonSchedulesArray);
+  static bool readSchedule(RGBLightState& settings, size_t index, JsonObject& root) {
+    if (index >= settings.schedules.schedules.size()) {
+      return false;
+    }
+    Schedules::serializeSchedule(settings.schedules.schedules[index], root);
+    return true;
   }
 
   static StateUpdateResult update(JsonObject& root, RGBLightState& lightState) {
@@ -264,25 +166,187 @@ class RGBLightState {
 
     return changed ? StateUpdateResult::CHANGED : StateUpdateResult::UNCHANGED;
   }
+
+  /**
+   * Binary form stored on flash: pins (3 bytes), color (3 bytes) and schedule count (2 bytes, little endian) followed
+   * by a fixed size record per schedule.
+   */
+  static void writeBinary(RGBLightState& settings, Print& out) {
+    uint8_t head[RGB_LIGHT_BINARY_HEAD_LENGTH];
+    head[0] = settings.pins.rPin;
+    head[1] = settings.pins.gPin;
+    head[2] = settings.pins.bPin;
+    head[3] = constrain(settings.color.r, 0, 255);
+    head[4] = constrain(settings.color.g, 0, 255);
+    head[5] = constrain(settings.color.b, 0, 255);
+    uint16_t scheduleCount = settings.schedules.schedules.size();
+    head[6] = scheduleCount;
+    head[7] = scheduleCount >> 8;
+    out.write(head, sizeof(head));
+    uint8_t record[RGB_LIGHT_BINARY_SCHEDULE_LENGTH];
+    for (uint16_t i = 0; i < scheduleCount; i++) {
+      Schedules::encodeSchedule(settings.schedules.schedules[i], record);
+      out.write(record, sizeof(record));
+    }
+  }
+
+  static StateUpdateResult readBinary(Stream& in, size_t length, RGBLightState& settings) {
+    uint8_t head[RGB_LIGHT_BINARY_HEAD_LENGTH];
+    if (length < sizeof(head) || in.readBytes((char*)head, sizeof(head)) != sizeof(head)) {
+      return StateUpdateResult::ERROR;
+    }
+    uint16_t scheduleCount = head[6] | (head[7] << 8);
+    if (length != sizeof(head) + (size_t)scheduleCount * RGB_LIGHT_BINARY_SCHEDULE_LENGTH) {
+      return StateUpdateResult::ERROR;
+    }
+    std::vector<Schedule> schedules;
+    schedules.reserve(scheduleCount);
+    uint8_t record[RGB_LIGHT_BINARY_SCHEDULE_LENGTH];
+    for (uint16_t i = 0; i < scheduleCount; i++) {
+      if (in.readBytes((char*)record, sizeof(record)) != sizeof(record)) {
+        return StateUpdateResult::ERROR;
+      }
+      schedules.push_back(Schedules::decodeSchedule(record));
+    }
+    RGBPins pins(head[0], head[1], head[2]);
+    RGBColor color(head[3], head[4], head[5]);
+    bool changed = settings.pins != pins || settings.color != color || settings.schedules.schedules != schedules;
+    settings.pins = pins;
+    settings.color = color;
+    settings.schedules.schedules.swap(schedules);
+    return changed ? StateUpdateResult::CHANGED : StateUpdateResult::UNCHANGED;
+  }
+
+  /**
+   * Compact snapshot for the state history: color (3 bytes), pins (3 bytes), schedule count (2 bytes, little endian)
+   * and schedules fingerprint (4 bytes, little endian).
+   */
+  static size_t encode(RGBLightState& settings, uint8_t* snapshot) {
+    snapshot[0] = constrain(settings.color.r, 0, 255);
+    snapshot[1] = constrain(settings.color.g, 0, 255);
+    snapshot[2] = constrain(settings.color.b, 0, 255);
+    snapshot[3] = settings.pins.rPin;
+    snapshot[4] = settings.pins.gPin;
+    snapshot[5] = settings.pins.bPin;
+    uint16_t scheduleCount = settings.schedules.schedules.size();
+    uint32_t scheduleHash = Schedules::fingerprint(settings.schedules);
+    for (size_t i = 0; i < 2; i++) {
+      snapshot[6 + i] = scheduleCount >> (8 * i);
+    }
+    for (size_t i = 0; i < 4; i++) {
+      snapshot[8 + i] = scheduleHash >> (8 * i);
+    }
+    return 12;
+  }
+
+  static void readSnapshot(const uint8_t* snapshot, size_t length, JsonObject& root) {
+    if (length < 12) {
+      return;
+    }
+    JsonObject colorJson = root.createNestedObject("color");
+    colorJson["r"] = snapshot[0];
+    colorJson["g"] = snapshot[1];
+    colorJson["b"] = snapshot[2];
+
+    JsonObject pinsJson = root.createNestedObject("pins");
+    pinsJson["rPin"] = snapshot[3];
+    pinsJson["gPin"] = snapshot[4];
+    pinsJson["bPin"] = snapshot[5];
+
+    root["schedule_count"] = snapshot[6] | (snapshot[7] << 8);
+    root["schedules_hash"] = (uint32_t)snapshot[8] | ((uint32_t)snapshot[9] << 8) | ((uint32_t)snapshot[10] << 16) |
+                             ((uint32_t)snapshot[11] << 24);
+  }
+};
+
+/**
+ * Builds the schedules of a streamed update one at a time, so an uploaded schedule list is never held as JSON.
+ */
+class RGBLightStateBuilder : public JsonStateBuilder<RGBLightState> {
+ public:
+  void beginElements() {
+    _schedulesReceived = true;
+  }
+
+  bool addElement(JsonObject& element) {
+    Schedule schedule;
+    if (Schedules::deserializeSchedule(element, schedule)) {
+      _schedules.push_back(schedule);
+    }
+    return true;
+  }
+
+  StateUpdateResult apply(JsonObject& root, RGBLightState& settings) {
+    root.remove("schedules");
+    StateUpdateResult result = RGBLightState::update(root, settings);
+    if (_schedulesReceived && settings.schedules.schedules != _schedules) {
+      settings.schedules.schedules.swap(_schedules);
+      result = StateUpdateResult::CHANGED;
+    }
+    return result;
+  }
+
+ private:
+  bool _schedulesReceived = false;
+  std::vector<Schedule> _schedules;
 };
 
+/**
+ * The output last driven, kept in RTC memory, which survives a restart but not a loss of power, so the light can be
+ * restored as soon as the service is constructed rather than once the settings are loaded and the schedules
+ * evaluated. The next transition is when the output was due to change (seconds since the epoch), zero if not known.
+ */
+struct RGBLightRuntime {
+  uint32_t magic;
+  uint8_t pins[3];
+  uint8_t color[3];
+  uint8_t reserved[2];
+  int64_t nextTransition;
+  uint32_t checksum;
+  uint32_t padding;
+};
+
+class ScheduleCalendarService;
+
 class RGBLightStateService : public StatefulService<RGBLightState> {
  public:
-  RGBLightStateService(AsyncWebServer* server, SecurityManager* securityManager, FS* fs);
+  RGBLightStateService(AsyncWebServer* server,
+                       SecurityManager* securityManager,
+                       FS* fs,
+                       WebSocketHub* webSocketHub,
+                       ScheduleCalendarService* scheduleCalendarService);
   void begin();
   void loop();
   void updateRGBLedState();
-  void temporarilyUpdateRGBLedState(const RGBColor& color);
+  void temporarilyUpdateRGBLedState(const RGBColor& color, int64_t nextTransition = 0);
+
+  /**
+   * Returns true, the color and the time the color is due to change if one of the light's schedules is active at the
+   * time.
+   */
+  bool activeColor(TimePoint now, RGBColor& color, int64_t& nextTransition);
 
  private:
   HttpEndpoint<RGBLightState> _httpEndpoint;
   WebSocketTxRx<RGBLightState> _webSocket;
   FSPersistence<RGBLightState> _fsPersistence;
+  StateHistory<RGBLightState> _history;
+  StateHistoryEndpoint _historyEndpoint;
+  NdjsonEndpoint<RGBLightState> _schedulesEndpoint;
+  ScheduleCalendarService* _scheduleCalendarService;
+  ScheduleTimeline _timeline;
+  uint32_t _timelineVersion;
 
   TimePoint lastCheckTime = Clock::now();
   RGBColor currentColor = RGBColor(0, 0, 0);
+  int64_t currentTransition = 0;
+  bool runtimeRestored = false;
 
+  void writeOutput(const RGBColor& color, int64_t nextTransition);
+  bool restoreRuntime();
+  void saveRuntime();
   void onConfigUpdated(const String& originId);
+  void socketStatus(AsyncWebServerRequest* request);
 };
 
 #endif
\ No newline at end of file
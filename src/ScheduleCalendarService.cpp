@@ -0,0 +1,158 @@
+#include <ScheduleCalendarService.h>
+
+ScheduleTable::ScheduleTable(FS* fs, const char* path) : _fs(fs), _path(path) {
+}
+
+bool ScheduleTable::open() {
+  clear();
+  if (!_fs || !_fs->exists(_path)) {
+    return false;
+  }
+  File file = _fs->open(_path, "r");
+  if (!file) {
+    return false;
+  }
+  bool opened = scan(file);
+  file.close();
+  if (!opened) {
+    Serial.printf_P(PSTR("Ignoring damaged schedule calendar %s\r\n"), _path.c_str());
+    clear();
+  }
+  return opened;
+}
+
+void ScheduleTable::encodeTrailer(uint8_t* trailer, uint32_t count, uint32_t checksum) {
+  memcpy(trailer, SCHEDULE_TABLE_MAGIC, 4);
+  trailer[4] = SCHEDULE_TABLE_SCHEMA_VERSION & 0xFF;
+  trailer[5] = SCHEDULE_TABLE_SCHEMA_VERSION >> 8;
+  trailer[6] = 0;
+  trailer[7] = 0;
+  for (size_t i = 0; i < 4; i++) {
+    trailer[8 + i] = count >> (8 * i);
+    trailer[12 + i] = checksum >> (8 * i);
+  }
+}
+
+/**
+ * Verifies the table in one pass, indexing each block as it goes by.
+ */
+bool ScheduleTable::scan(File& file) {
+  size_t size = file.size();
+  if (size < SCHEDULE_TABLE_TRAILER_LENGTH ||
+      (size - SCHEDULE_TABLE_TRAILER_LENGTH) % RGB_LIGHT_BINARY_SCHEDULE_LENGTH != 0) {
+    return false;
+  }
+  uint32_t count = (size - SCHEDULE_TABLE_TRAILER_LENGTH) / RGB_LIGHT_BINARY_SCHEDULE_LENGTH;
+  uint8_t trailer[SCHEDULE_TABLE_TRAILER_LENGTH];
+  if (count > SCHEDULE_TABLE_MAX_ENTRIES || !file.seek(size - SCHEDULE_TABLE_TRAILER_LENGTH) ||
+      file.read(trailer, sizeof(trailer)) != sizeof(trailer) || memcmp(trailer, SCHEDULE_TABLE_MAGIC, 4) != 0 ||
+      (trailer[4] | (trailer[5] << 8)) != SCHEDULE_TABLE_SCHEMA_VERSION || readUint32(trailer + 8) != count ||
+      !file.seek(0)) {
+    return false;
+  }
+
+  uint32_t checksum = 0;
+  for (uint32_t first = 0; first < count; first += SCHEDULE_TABLE_BLOCK_LENGTH) {
+    size_t length = count - first < SCHEDULE_TABLE_BLOCK_LENGTH ? count - first : SCHEDULE_TABLE_BLOCK_LENGTH;
+    size_t bytes = length * RGB_LIGHT_BINARY_SCHEDULE_LENGTH;
+    if (file.read(&_page[0][0], bytes) != bytes) {
+      return false;
+    }
+    checksum = FSPersistenceBase::crc32(checksum, &_page[0][0], bytes);
+    if (!indexBlock(&_page[0][0], length)) {
+      return false;
+    }
+  }
+  return checksum == readUint32(trailer + 12);
+}
+
+const uint8_t* ScheduleTable::readBlock(size_t block, size_t first, size_t length) {
+  File file = _fs->open(_path, "r");
+  if (!file) {
+    return nullptr;
+  }
+  size_t bytes = length * RGB_LIGHT_BINARY_SCHEDULE_LENGTH;
+  bool loaded = file.seek(first * RGB_LIGHT_BINARY_SCHEDULE_LENGTH) && file.read(&_page[0][0], bytes) == bytes;
+  file.close();
+  return loaded ? &_page[0][0] : nullptr;
+}
+
+uint32_t ScheduleTable::readUint32(const uint8_t* data) {
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+ScheduleTableBuilder::ScheduleTableBuilder(FS* fs, const char* path) :
+    _fs(fs), _path(path), _staging(false), _count(0), _checksum(0), _blockLength(0) {
+}
+
+ScheduleTableBuilder::~ScheduleTableBuilder() {
+  // an upload which failed or was abandoned leaves the table as it was
+  if (_staging) {
+    FSPersistenceBase::abortStagedFile(_fs, _path);
+  }
+}
+
+void ScheduleTableBuilder::beginElements() {
+  _staging = FSPersistenceBase::beginStagedFile(_fs, _path);
+}
+
+bool ScheduleTableBuilder::addElement(JsonObject& element) {
+  Schedule schedule;
+  if (!_staging || _count == SCHEDULE_TABLE_MAX_ENTRIES || !Schedules::deserializeSchedule(element, schedule) ||
+      !schedule.daysActive.empty() || schedule.end < schedule.start || (_count && schedule.start < _lastStart)) {
+    return false;
+  }
+  Schedules::encodeSchedule(schedule, _block[_blockLength++]);
+  _lastStart = schedule.start;
+  _count++;
+  return _blockLength < SCHEDULE_TABLE_BLOCK_LENGTH || flushBlock();
+}
+
+StateUpdateResult ScheduleTableBuilder::apply(JsonObject& root, ScheduleTable& settings) {
+  if (!_staging || !flushBlock()) {
+    return StateUpdateResult::ERROR;
+  }
+  uint8_t trailer[SCHEDULE_TABLE_TRAILER_LENGTH];
+  ScheduleTable::encodeTrailer(trailer, _count, _checksum);
+  if (!FSPersistenceBase::appendStagedFile(_fs, _path, trailer, sizeof(trailer)) ||
+      !FSPersistenceBase::commitStagedFile(_fs, _path)) {
+    return StateUpdateResult::ERROR;
+  }
+  _staging = false;
+  settings.open();
+  return StateUpdateResult::CHANGED;
+}
+
+bool ScheduleTableBuilder::flushBlock() {
+  if (!_blockLength) {
+    return true;
+  }
+  size_t bytes = _blockLength * RGB_LIGHT_BINARY_SCHEDULE_LENGTH;
+  _checksum = FSPersistenceBase::crc32(_checksum, &_block[0][0], bytes);
+  _blockLength = 0;
+  return FSPersistenceBase::appendStagedFile(_fs, _path, &_block[0][0], bytes);
+}
+
+ScheduleCalendarService::ScheduleCalendarService(AsyncWebServer* server, SecurityManager* securityManager, FS* fs) :
+    StatefulService<ScheduleTable>(fs),
+    _ndjsonEndpoint(ScheduleTable::readEntry,
+                    [fs]() { return new ScheduleTableBuilder(fs); },
+                    this,
+                    server,
+                    SCHEDULE_CALENDAR_ENDPOINT_PATH,
+                    securityManager,
+                    AuthenticationPredicates::IS_AUTHENTICATED) {
+}
+
+void ScheduleCalendarService::begin() {
+  read([](ScheduleTable& table) { table.open(); });
+}
+
+bool ScheduleCalendarService::activeColor(TimePoint now, RGBColor& color, int64_t& nextTransition) {
+  bool active = false;
+  read([&](ScheduleTable& table) {
+    active = table.evaluate(now, color);
+    nextTransition = table.nextTransition();
+  });
+  return active;
+}
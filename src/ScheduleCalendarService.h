@@ -0,0 +1,97 @@
+#ifndef ScheduleCalendarService_h
+#define ScheduleCalendarService_h
+
+#include <RGBLightStateService.h>
+
+#define SCHEDULE_CALENDAR_FILE "/config/rgbLightCalendar.tbl"
+#define SCHEDULE_CALENDAR_ENDPOINT_PATH "/rest/rgbLightCalendar"
+
+#ifndef SCHEDULE_TABLE_MAX_ENTRIES
+#define SCHEDULE_TABLE_MAX_ENTRIES 8192
+#endif
+
+// the table is the binary schedule records sorted by start, followed by the magic, the schema version (2 bytes), 2
+// reserved bytes, then the entry count and the CRC-32 of the records (4 bytes each), all little endian
+#define SCHEDULE_TABLE_MAGIC "SCTB"
+#define SCHEDULE_TABLE_TRAILER_LENGTH 16
+#define SCHEDULE_TABLE_SCHEMA_VERSION 1
+
+/**
+ * A calendar of dated schedules sorted by start, kept on flash so it may hold far more entries than fit in RAM, such
+ * as a year of holiday lighting. It is looked up as the light's own schedules are, paging one block of entries into RAM
+ * at a time. A table no larger than one block stays in RAM once opened.
+ */
+class ScheduleTable : public ScheduleIndex {
+ public:
+  ScheduleTable(FS* fs = nullptr, const char* path = SCHEDULE_CALENDAR_FILE);
+
+  /**
+   * Reads the table's index from flash, leaving the table empty if the file is missing or fails its checksum.
+   */
+  bool open();
+
+  static bool readEntry(ScheduleTable& table, size_t index, JsonObject& root) {
+    Schedule schedule;
+    if (!table.entry(index, schedule)) {
+      return false;
+    }
+    Schedules::serializeSchedule(schedule, root);
+    return true;
+  }
+
+  static void encodeTrailer(uint8_t* trailer, uint32_t count, uint32_t checksum);
+
+ protected:
+  const uint8_t* readBlock(size_t block, size_t first, size_t length);
+
+ private:
+  FS* _fs;
+  String _path;
+  uint8_t _page[SCHEDULE_TABLE_BLOCK_LENGTH][RGB_LIGHT_BINARY_SCHEDULE_LENGTH];
+
+  bool scan(File& file);
+
+  static uint32_t readUint32(const uint8_t* data);
+};
+
+/**
+ * Writes an uploaded calendar to flash as it arrives, a block of entries at a time, replacing the table once the
+ * upload is complete. Entries must be dated, that is have no active days, and sorted by start.
+ */
+class ScheduleTableBuilder : public JsonStateBuilder<ScheduleTable> {
+ public:
+  ScheduleTableBuilder(FS* fs, const char* path = SCHEDULE_CALENDAR_FILE);
+  ~ScheduleTableBuilder();
+
+  void beginElements();
+  bool addElement(JsonObject& element);
+  StateUpdateResult apply(JsonObject& root, ScheduleTable& settings);
+
+ private:
+  FS* _fs;
+  String _path;
+  bool _staging;
+  uint32_t _count;
+  uint32_t _checksum;
+  TimePoint _lastStart;
+  uint8_t _block[SCHEDULE_TABLE_BLOCK_LENGTH][RGB_LIGHT_BINARY_SCHEDULE_LENGTH];
+  size_t _blockLength;
+
+  bool flushBlock();
+};
+
+class ScheduleCalendarService : public StatefulService<ScheduleTable> {
+ public:
+  ScheduleCalendarService(AsyncWebServer* server, SecurityManager* securityManager, FS* fs);
+  void begin();
+
+  /**
+   * Returns true, the color and the time the color is due to change if a calendar entry is active at the time.
+   */
+  bool activeColor(TimePoint now, RGBColor& color, int64_t& nextTransition);
+
+ private:
+  NdjsonEndpoint<ScheduleTable> _ndjsonEndpoint;
+};
+
+#endif  // end ScheduleCalendarService_h
@@ -0,0 +1,247 @@
+#include <ScheduleIndex.h>
+
+#include <ctime>
+#include <limits>
+
+#define SECONDS_PER_DAY 86400
+
+static const size_t NO_BLOCK = (size_t)-1;
+
+ScheduleIndex::ScheduleIndex() :
+    _count(0),
+    _lastStart(std::numeric_limits<int64_t>::min()),
+    _window(nullptr),
+    _windowBlock(NO_BLOCK),
+    _windowLength(0),
+    _compiled(false),
+    _validFrom(0),
+    _nextTransition(0),
+    _active(false) {
+}
+
+bool ScheduleIndex::entry(size_t index, Schedule& schedule) {
+  if (index >= _count || !loadBlock(index / SCHEDULE_TABLE_BLOCK_LENGTH)) {
+    return false;
+  }
+  schedule = Schedules::decodeSchedule(record(index % SCHEDULE_TABLE_BLOCK_LENGTH));
+  return true;
+}
+
+bool ScheduleIndex::evaluate(TimePoint now, RGBColor& color) {
+  int64_t seconds = std::chrono::duration_cast<Seconds>(now.time_since_epoch()).count();
+  // a clock set backwards, such as by the first NTP sync, may precede the compiled outcome
+  if ((!_compiled || seconds < _validFrom || seconds >= _nextTransition) && !compile(seconds)) {
+    return false;
+  }
+  if (_active) {
+    color = _color;
+  }
+  return _active;
+}
+
+int64_t ScheduleIndex::nextTransition() {
+  return _compiled && _nextTransition != std::numeric_limits<int64_t>::max() ? _nextTransition : 0;
+}
+
+void ScheduleIndex::clear() {
+  _count = 0;
+  _blocks.clear();
+  _lastStart = std::numeric_limits<int64_t>::min();
+  _window = nullptr;
+  _windowBlock = NO_BLOCK;
+  _windowLength = 0;
+  _compiled = false;
+}
+
+bool ScheduleIndex::indexBlock(const uint8_t* records, size_t length) {
+  _window = records;
+  _windowBlock = NO_BLOCK;
+  Block block = {readInt64(records), std::numeric_limits<int64_t>::min()};
+  for (size_t i = 0; i < length; i++) {
+    int64_t start = readInt64(record(i));
+    int64_t end = readInt64(record(i) + 8);
+    if (start < _lastStart) {
+      return false;
+    }
+    _lastStart = start;
+    if (end > block.latestEnd) {
+      block.latestEnd = end;
+    }
+  }
+  _blocks.push_back(block);
+  _count += length;
+  _windowBlock = _blocks.size() - 1;
+  _windowLength = length;
+  return true;
+}
+
+bool ScheduleIndex::loadBlock(size_t block) {
+  if (block == _windowBlock) {
+    return true;
+  }
+  if (block >= _blocks.size()) {
+    return false;
+  }
+  size_t first = block * SCHEDULE_TABLE_BLOCK_LENGTH;
+  size_t length = _count - first < SCHEDULE_TABLE_BLOCK_LENGTH ? _count - first : SCHEDULE_TABLE_BLOCK_LENGTH;
+  _windowBlock = NO_BLOCK;
+  _window = readBlock(block, first, length);
+  if (!_window) {
+    return false;
+  }
+  _windowBlock = block;
+  _windowLength = length;
+  return true;
+}
+
+/**
+ * Finds the latest starting entry which has not ended at the time, walking back from the last entry started at the
+ * time and only reading the blocks whose latest end has not passed. The outcome holds until the next entry starts or
+ * the active entry ends, whichever comes first.
+ */
+bool ScheduleIndex::compile(int64_t now) {
+  _compiled = false;
+  _active = false;
+  _validFrom = now;
+  _nextTransition = std::numeric_limits<int64_t>::max();
+
+  auto after = std::upper_bound(
+      _blocks.begin(), _blocks.end(), now, [](int64_t time, const Block& block) { return time < block.firstStart; });
+  if (after != _blocks.end()) {
+    _nextTransition = after->firstStart;
+  }
+  if (after == _blocks.begin()) {
+    _compiled = true;
+    return true;
+  }
+
+  size_t last = after - _blocks.begin() - 1;
+  if (!loadBlock(last)) {
+    return false;
+  }
+  size_t started = _windowLength;
+  while (started > 0 && readInt64(record(started - 1)) > now) {
+    started--;
+  }
+  if (started < _windowLength) {
+    _nextTransition = readInt64(record(started));
+  }
+
+  for (size_t block = last + 1; block-- > 0;) {
+    if (_blocks[block].latestEnd < now) {
+      continue;
+    }
+    if (!loadBlock(block)) {
+      return false;
+    }
+    for (size_t i = block == last ? started : _windowLength; i-- > 0;) {
+      int64_t end = readInt64(record(i) + 8);
+      if (end >= now) {
+        _active = true;
+        _color = RGBColor(record(i)[16], record(i)[17], record(i)[18]);
+        if (end < _nextTransition) {
+          _nextTransition = end + 1;
+        }
+        _compiled = true;
+        return true;
+      }
+    }
+  }
+  _compiled = true;
+  return true;
+}
+
+int64_t ScheduleIndex::readInt64(const uint8_t* data) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < 8; i++) {
+    value |= (uint64_t)data[i] << (8 * i);
+  }
+  return (int64_t)value;
+}
+
+ScheduleTimeline::ScheduleTimeline() : _from(0), _until(0) {
+}
+
+void ScheduleTimeline::build(const Schedules& schedules, TimePoint now) {
+  int64_t seconds = std::chrono::duration_cast<Seconds>(now.time_since_epoch()).count();
+  int64_t today = seconds - ((seconds % SECONDS_PER_DAY) + SECONDS_PER_DAY) % SECONDS_PER_DAY;
+  _from = today - SECONDS_PER_DAY;
+  _until = _from + SCHEDULE_TIMELINE_DAYS * SECONDS_PER_DAY;
+
+  std::vector<Schedule> entries;
+  uint8_t record[RGB_LIGHT_BINARY_SCHEDULE_LENGTH];
+  for (const Schedule& schedule : schedules.schedules) {
+    int64_t start = std::chrono::duration_cast<Seconds>(schedule.start.time_since_epoch()).count();
+    int64_t end = std::chrono::duration_cast<Seconds>(schedule.end.time_since_epoch()).count();
+    if (end >= _from && end >= start) {
+      entries.push_back(Schedule(schedule.start, schedule.end, schedule.color));
+    }
+    Schedules::encodeSchedule(schedule, record);
+    uint8_t days = schedule.daysActive.size() == 7 ? 0x7F : record[19];
+    int64_t startOfDay = ((start % SECONDS_PER_DAY) + SECONDS_PER_DAY) % SECONDS_PER_DAY;
+    int64_t endOfDay = ((end % SECONDS_PER_DAY) + SECONDS_PER_DAY) % SECONDS_PER_DAY;
+    if (!days || startOfDay > endOfDay) {
+      continue;
+    }
+    for (int64_t day = _from; day < _until; day += SECONDS_PER_DAY) {
+      addWeekly(entries, day + startOfDay, day + endOfDay, days, schedule.color);
+    }
+  }
+  std::stable_sort(entries.begin(), entries.end());
+
+  clear();
+  _records.clear();
+  _records.shrink_to_fit();
+  _records.resize(entries.size() * RGB_LIGHT_BINARY_SCHEDULE_LENGTH);
+  for (size_t i = 0; i < entries.size(); i++) {
+    Schedules::encodeSchedule(entries[i], &_records[i * RGB_LIGHT_BINARY_SCHEDULE_LENGTH]);
+  }
+  for (size_t first = 0; first < entries.size(); first += SCHEDULE_TABLE_BLOCK_LENGTH) {
+    size_t length = entries.size() - first < SCHEDULE_TABLE_BLOCK_LENGTH ? entries.size() - first
+                                                                          : SCHEDULE_TABLE_BLOCK_LENGTH;
+    indexBlock(&_records[first * RGB_LIGHT_BINARY_SCHEDULE_LENGTH], length);
+  }
+}
+
+bool ScheduleTimeline::covers(TimePoint now) {
+  int64_t seconds = std::chrono::duration_cast<Seconds>(now.time_since_epoch()).count();
+  return seconds >= _from && seconds < _until;
+}
+
+int64_t ScheduleTimeline::nextTransition() {
+  int64_t transition = ScheduleIndex::nextTransition();
+  return transition && transition < _until ? transition : _until;
+}
+
+const uint8_t* ScheduleTimeline::readBlock(size_t block, size_t first, size_t length) {
+  return &_records[first * RGB_LIGHT_BINARY_SCHEDULE_LENGTH];
+}
+
+/**
+ * Adds one day's time-of-day window, split at local midnight when it spans two local days, keeping the parts falling
+ * on active days.
+ */
+void ScheduleTimeline::addWeekly(std::vector<Schedule>& entries,
+                                 int64_t start,
+                                 int64_t end,
+                                 uint8_t days,
+                                 const RGBColor& color) {
+  time_t time = start;
+  uint8_t startDay = std::localtime(&time)->tm_wday;
+  time = end;
+  std::tm* local = std::localtime(&time);
+  uint8_t endDay = local->tm_wday;
+  int64_t midnight = end - (local->tm_hour * 3600 + local->tm_min * 60 + local->tm_sec);
+  if (startDay == endDay || midnight <= start) {
+    if (days & (1 << endDay)) {
+      entries.push_back(Schedule(TimePoint(Seconds(start)), TimePoint(Seconds(end)), color));
+    }
+    return;
+  }
+  if (days & (1 << startDay)) {
+    entries.push_back(Schedule(TimePoint(Seconds(start)), TimePoint(Seconds(midnight - 1)), color));
+  }
+  if (days & (1 << endDay)) {
+    entries.push_back(Schedule(TimePoint(Seconds(midnight)), TimePoint(Seconds(end)), color));
+  }
+}
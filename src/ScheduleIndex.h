@@ -0,0 +1,137 @@
+#ifndef ScheduleIndex_h
+#define ScheduleIndex_h
+
+#include <Schedules.h>
+
+// entries held in RAM at once, a table no larger than one block is held in RAM entirely
+#ifndef SCHEDULE_TABLE_BLOCK_LENGTH
+#define SCHEDULE_TABLE_BLOCK_LENGTH 32
+#endif
+
+// days of weekly schedules compiled at once, from the day before the current one (UTC days)
+#ifndef SCHEDULE_TIMELINE_DAYS
+#define SCHEDULE_TIMELINE_DAYS 3
+#endif
+
+/**
+ * The compiled-timeline lookup shared by the light's own schedules in RAM and the schedule calendar on flash.
+ *
+ * Entries are dated binary schedule records sorted by start, in blocks of SCHEDULE_TABLE_BLOCK_LENGTH entries. RAM
+ * holds the first start and the latest end of every block, from which the blocks that could hold the active entry are
+ * found without reading the others. Subclasses supply the records of one block at a time, wherever they are kept.
+ *
+ * An entry is active from its start to its end, both inclusive, and the latest starting active entry wins.
+ * evaluate() compiles the outcome into the active color and the next transition, the earliest time at which the
+ * outcome can change, and answers from that until the transition is reached, so blocks are only read as time advances
+ * past them.
+ */
+class ScheduleIndex {
+ public:
+  ScheduleIndex();
+  virtual ~ScheduleIndex() {
+  }
+
+  size_t size() {
+    return _count;
+  }
+
+  bool entry(size_t index, Schedule& schedule);
+
+  /**
+   * Returns true and the color if an entry is active at the time.
+   */
+  bool evaluate(TimePoint now, RGBColor& color);
+
+  /**
+   * The earliest time the last evaluation can change (seconds since the epoch), zero if it never does.
+   */
+  virtual int64_t nextTransition();
+
+ protected:
+  size_t _count;
+
+  /**
+   * Empties the index, leaving the previous outcome to be compiled again.
+   */
+  void clear();
+
+  /**
+   * Indexes the next block's records, returns false if they do not follow on from the previous block in order of start.
+   * The records are left as the current block.
+   */
+  bool indexBlock(const uint8_t* records, size_t length);
+
+  /**
+   * Returns the records of the block, starting at entry first, or nullptr if they cannot be read. The records need only
+   * remain valid until the next call.
+   */
+  virtual const uint8_t* readBlock(size_t block, size_t first, size_t length) = 0;
+
+  static int64_t readInt64(const uint8_t* data);
+
+ private:
+  struct Block {
+    int64_t firstStart;
+    int64_t latestEnd;
+  };
+
+  std::vector<Block> _blocks;
+  int64_t _lastStart;
+
+  const uint8_t* _window;
+  size_t _windowBlock;
+  size_t _windowLength;
+
+  bool _compiled;
+  int64_t _validFrom;
+  int64_t _nextTransition;
+  bool _active;
+  RGBColor _color;
+
+  bool loadBlock(size_t block);
+  bool compile(int64_t now);
+
+  const uint8_t* record(size_t index) {
+    return _window + index * RGB_LIGHT_BINARY_SCHEDULE_LENGTH;
+  }
+};
+
+/**
+ * The light's schedules compiled into dated entries for the days around the current time. A schedule is active over
+ * its own start to end and, if it has active days, at the same time of day (UTC) on each of them, a day being active
+ * by its local weekday. Time-of-day windows ending before they start are never active.
+ *
+ * The entries are compiled again when time leaves the days they cover, the next transition never lying beyond them.
+ */
+class ScheduleTimeline : public ScheduleIndex {
+ public:
+  ScheduleTimeline();
+
+  /**
+   * Compiles the schedules for SCHEDULE_TIMELINE_DAYS days from the day before the time.
+   */
+  void build(const Schedules& schedules, TimePoint now);
+
+  /**
+   * Returns true if the compiled days include the time.
+   */
+  bool covers(TimePoint now);
+
+  int64_t nextTransition();
+
+ protected:
+  const uint8_t* readBlock(size_t block, size_t first, size_t length);
+
+ private:
+  std::vector<uint8_t> _records;
+  int64_t _from;
+  int64_t _until;
+
+  static void addWeekly(std::vector<Schedule>& entries,
+                        int64_t start,
+                        int64_t end,
+                        uint8_t days,
+                        const RGBColor& color);
+};
+
+#endif  // end ScheduleIndex_h
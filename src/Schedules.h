@@ -0,0 +1,255 @@
+#ifndef Schedules_h
+#define Schedules_h
+
+#include <StatefulService.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::system_clock;
+using TimePoint = Clock::time_point;
+using Seconds = std::chrono::seconds;
+
+// a schedule encoded as a binary record, see Schedules::encodeSchedule
+#define RGB_LIGHT_BINARY_SCHEDULE_LENGTH 20
+
+struct RGBColor {
+  int r, g, b;
+
+  RGBColor(int red = 0, int green = 0, int blue = 0) : r(red), g(green), b(blue) {
+  }
+
+  bool operator==(const RGBColor& other) const {
+    return r == other.r && g == other.g && b == other.b;
+  }
+  bool operator!=(const RGBColor& other) const {
+    return !(*this == other);
+  }
+
+  bool isOff() const {
+    return r == 0 && g == 0 && b == 0;
+  }
+
+  void setOff() {
+    r = 0;
+    g = 0;
+    b = 0;
+  }
+
+  void setColor(int red, int green, int blue) {
+    r = red;
+    g = green;
+    b = blue;
+  }
+};
+
+struct Schedule {
+  TimePoint start;
+  TimePoint end;
+  RGBColor color;
+  std::vector<std::string> daysActive;
+
+  Schedule(TimePoint s = Clock::now(),
+           TimePoint e = Clock::now() + Seconds(60),
+           RGBColor c = RGBColor(0, 0, 0),
+           std::vector<std::string> days = {}) :
+      start(s), end(e), color(c), daysActive(days) {
+  }
+
+  bool isActiveOnDay(const std::string& day) const {
+    // If daysActive is empty, return false
+    if (daysActive.empty()) {
+      return false;
+    }
+    // If daysActive contains all seven days, return true
+    if (daysActive.size() == 7) {
+      return true;
+    }
+    // Else - search the list to see if the current day is active
+    return std::find(daysActive.begin(), daysActive.end(), day) != daysActive.end();
+  }
+
+  bool operator==(const Schedule& other) const {
+    if (start != other.start || end != other.end || color != other.color ||
+        daysActive.size() != other.daysActive.size()) {
+      return false;
+    }
+    auto sortedDays = daysActive;
+    auto sortedOtherDays = other.daysActive;
+    std::sort(sortedDays.begin(), sortedDays.end());
+    std::sort(sortedOtherDays.begin(), sortedOtherDays.end());
+    return sortedDays == sortedOtherDays;
+  }
+
+  bool operator!=(const Schedule& other) const {
+    return !(*this == other);
+  }
+  bool operator<(const Schedule& other) const {
+    return start < other.start;
+  }
+  bool operator>(const Schedule& other) const {
+    return start > other.start;
+  }
+  bool operator<=(const Schedule& other) const {
+    return start <= other.start;
+  }
+  bool operator>=(const Schedule& other) const {
+    return start >= other.start;
+  }
+};
+
+class Schedules {
+ public:
+  std::vector<Schedule> schedules;
+
+  static void serializeToJsonAndRead(const Schedules& schedules, JsonArray& schedulesArray) {
+    for (const auto& schedule : schedules.schedules) {
+      JsonObject scheduleObj = schedulesArray.createNestedObject();
+      serializeSchedule(schedule, scheduleObj);
+    }
+  }
+
+  // the day names are copied into the document
+  static size_t jsonCapacity(const Schedule& schedule) {
+    size_t capacity = JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(schedule.daysActive.size()) + JSON_OBJECT_SIZE(3);
+    for (const auto& day : schedule.daysActive) {
+      capacity += day.length() + 1;
+    }
+    return capacity;
+  }
+
+  static void serializeSchedule(const Schedule& schedule, JsonObject& scheduleObj) {
+    scheduleObj["start"] = std::chrono::duration_cast<Seconds>(schedule.start.time_since_epoch()).count();
+    scheduleObj["end"] = std::chrono::duration_cast<Seconds>(schedule.end.time_since_epoch()).count();
+    JsonArray daysArray = scheduleObj.createNestedArray("daysActive");
+    for (const auto& day : schedule.daysActive) {
+      daysArray.add(day);
+    }
+    JsonObject colorObj = scheduleObj.createNestedObject("color");
+    colorObj["r"] = schedule.color.r;
+    colorObj["g"] = schedule.color.g;
+    colorObj["b"] = schedule.color.b;
+  }
+
+  static StateUpdateResult deserializeJsonAndUpdate(const JsonArray& schedulesArray, Schedules& settings) {
+    std::vector<Schedule> newSchedules;
+
+    for (JsonObject scheduleObj : schedulesArray) {
+      Schedule schedule;
+      if (deserializeSchedule(scheduleObj, schedule)) {
+        newSchedules.push_back(schedule);
+      }
+    }
+
+    // Compare new schedules with existing ones to determine if there's a change
+    if (settings.schedules != newSchedules) {
+      settings.schedules.swap(newSchedules);
+      return StateUpdateResult::CHANGED;
+    }
+
+    return StateUpdateResult::UNCHANGED;
+  }
+
+  static bool deserializeSchedule(JsonObject& scheduleObj, Schedule& schedule) {
+    if (!scheduleObj.containsKey("start") || !scheduleObj.containsKey("end") ||
+        !scheduleObj["color"].is<JsonObject>()) {
+      Serial.println("Missing schedule information");
+      return false;  // Skip malformed entries
+    }
+
+    auto start_seconds = Seconds(scheduleObj["start"].as<long long>());
+    auto end_seconds = Seconds(scheduleObj["end"].as<long long>());
+    TimePoint start = TimePoint(start_seconds);
+    TimePoint end = TimePoint(end_seconds);
+
+    JsonObject colorObj = scheduleObj["color"];
+    int r = colorObj["r"].as<int>();
+    int g = colorObj["g"].as<int>();
+    int b = colorObj["b"].as<int>();
+
+    JsonArray daysJsonArray = scheduleObj["daysActive"];
+    std::vector<std::string> days;
+    for (auto day : daysJsonArray) {
+      days.push_back(day.as<std::string>());
+    }
+    schedule = Schedule(start, end, RGBColor(r, g, b), days);
+    return true;
+  }
+
+  /**
+   * Binary schedule record: start and end (8 bytes each, seconds since the epoch, little endian), color (3 bytes) and
+   * the active days as a bitmask, bit 0 being Sunday. Day names other than the seven weekdays are not kept.
+   */
+  static void encodeSchedule(const Schedule& schedule, uint8_t* record) {
+    int64_t start = std::chrono::duration_cast<Seconds>(schedule.start.time_since_epoch()).count();
+    int64_t end = std::chrono::duration_cast<Seconds>(schedule.end.time_since_epoch()).count();
+    for (size_t i = 0; i < 8; i++) {
+      record[i] = (uint64_t)start >> (8 * i);
+      record[8 + i] = (uint64_t)end >> (8 * i);
+    }
+    record[16] = constrain(schedule.color.r, 0, 255);
+    record[17] = constrain(schedule.color.g, 0, 255);
+    record[18] = constrain(schedule.color.b, 0, 255);
+    uint8_t days = 0;
+    for (uint8_t day = 0; day < 7; day++) {
+      if (std::find(schedule.daysActive.begin(), schedule.daysActive.end(), weekdayName(day)) !=
+          schedule.daysActive.end()) {
+        days |= 1 << day;
+      }
+    }
+    record[19] = days;
+  }
+
+  static Schedule decodeSchedule(const uint8_t* record) {
+    uint64_t start = 0;
+    uint64_t end = 0;
+    for (size_t i = 0; i < 8; i++) {
+      start |= (uint64_t)record[i] << (8 * i);
+      end |= (uint64_t)record[8 + i] << (8 * i);
+    }
+    std::vector<std::string> days;
+    for (uint8_t day = 0; day < 7; day++) {
+      if (record[19] & (1 << day)) {
+        days.push_back(weekdayName(day));
+      }
+    }
+    return Schedule(TimePoint(Seconds((int64_t)start)),
+                    TimePoint(Seconds((int64_t)end)),
+                    RGBColor(record[16], record[17], record[18]),
+                    days);
+  }
+
+  static const char* weekdayName(uint8_t day) {
+    static const char* const names[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
+    return day < 7 ? names[day] : "";
+  }
+
+  const std::vector<Schedule>& getSchedules() const {
+    return schedules;
+  }
+
+  // FNV-1a hash of the schedules, used to detect schedule changes without storing them
+  static uint32_t fingerprint(const Schedules& schedules) {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const void* data, size_t length) {
+      const uint8_t* bytes = (const uint8_t*)data;
+      for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+      }
+    };
+    for (const auto& schedule : schedules.schedules) {
+      long long start = std::chrono::duration_cast<Seconds>(schedule.start.time_since_epoch()).count();
+      long long end = std::chrono::duration_cast<Seconds>(schedule.end.time_since_epoch()).count();
+      mix(&start, sizeof(start));
+      mix(&end, sizeof(end));
+      mix(&schedule.color, sizeof(schedule.color));
+      for (const auto& day : schedule.daysActive) {
+        mix(day.c_str(), day.length() + 1);
+      }
+    }
+    return hash;
+  }
+};
+
+#endif  // end Schedules_h
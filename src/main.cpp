@@ -4,33 +4,43 @@
 #include <time.h>
 
 #include <RGBLightStateService.h>
+#include <ScheduleCalendarService.h>
 
 #define SERIAL_BAUD_RATE 115200
 
 AsyncWebServer server(80);
 ESP8266React esp32React(&server);
 
-RGBLightStateService rgbLightStateService =
-    RGBLightStateService(&server, esp32React.getSecurityManager(), esp32React.getFS());
+ScheduleCalendarService scheduleCalendarService =
+    ScheduleCalendarService(&server, esp32React.getSecurityManager(), esp32React.getFS());
+
+RGBLightStateService rgbLightStateService = RGBLightStateService(&server,
+                                                                 esp32React.getSecurityManager(),
+                                                                 esp32React.getFS(),
+                                                                 esp32React.getWebSocketHub(),
+                                                                 &scheduleCalendarService);
 
 void setup() {
   // start serial and filesystem
   Serial.begin(SERIAL_BAUD_RATE);
   Serial.println("ESP32 is up and running...");
 
+  // load the light settings once networking is under way
+  esp32React.getBootSequence()->addStage("rgbLightState", []() { rgbLightStateService.begin(); }, true);
+  esp32React.getBootSequence()->addStage("scheduleCalendar", []() { scheduleCalendarService.begin(); }, true);
+
   // start the framework and demo project
   esp32React.begin();
 
-  // load the initial light settings
-  rgbLightStateService.begin();
-
-  // start the server
-  server.begin();
+  // start the server once every service has loaded its settings, so none is served or updated with its defaults
+  esp32React.getBootSequence()->onComplete([]() { server.begin(); });
 }
 
 void loop() {
   // run the framework's loop function
   esp32React.loop();
-  rgbLightStateService.loop();
+  if (esp32React.getBootSequence()->isComplete()) {
+    rgbLightStateService.loop();
+  }
   // loopPrintTime();
 }